@@ -0,0 +1,599 @@
+/*
+ * The assembler: LC-3 source in, words straight into vm->memory, in one
+ * pass. An operand naming a label that is not defined yet leaves a fixup
+ * on the label, patched as soon as the label turns up, so the source is
+ * read once and nothing is built in between. Labels live in an
+ * open-addressing hash table keyed by pointers into the source itself.
+ *
+ * The syntax is the usual one: ; comments, .ORIG/.END sections, .FILL,
+ * .BLKW and .STRINGZ, #decimal and xhex numbers, opcodes and registers in
+ * any case, labels as written.
+ */
+#define ASM_TABLE_MIN 1024 /* slots, a power of two */
+#define ASM_TOKENS 8       /* the most a line can hold, label and opcode included */
+
+enum
+{
+    ASM_OFFSET9,   /* PCoffset9, from the word after */
+    ASM_OFFSET11,  /* PCoffset11 */
+    ASM_WORD       /* all of a .FILL */
+};
+
+struct asm_fixup
+{
+    uint16_t address;
+    uint8_t kind;      /* ASM_* */
+    uint32_t line;
+    int32_t next;      /* the label's next fixup, -1 at the end */
+};
+
+struct asm_symbol
+{
+    const char* name;  /* into the source, NULL for a free slot */
+    uint32_t length;
+    uint32_t hash;
+    int defined;
+    uint16_t address;
+    int32_t fixups;    /* the first still waiting, -1 if none */
+    uint32_t line;     /* where it was first used or defined */
+};
+
+struct asm_token
+{
+    const char* text;
+    uint32_t length;
+};
+
+struct assembler
+{
+    struct vm* vm;
+    const char* path;
+    uint32_t line;
+    struct asm_symbol* table;
+    uint32_t capacity;         /* power of two */
+    uint32_t used;
+    struct asm_fixup* fixups;
+    uint32_t fixup_count;
+    uint32_t fixup_capacity;
+    uint32_t pc;               /* the next word */
+    int in_section;            /* between .ORIG and .END */
+};
+
+/* forms of operands */
+enum
+{
+    ASM_ALU,      /* ADD/AND DR, SR1, SR2 or imm5 */
+    ASM_NOT,      /* NOT DR, SR */
+    ASM_BR,       /* BRnzp label */
+    ASM_JMP,      /* JMP BaseR */
+    ASM_RET,
+    ASM_JSR,      /* JSR label */
+    ASM_JSRR,     /* JSRR BaseR */
+    ASM_PCREL,    /* LD/LDI/LEA/ST/STI R, label */
+    ASM_BASE,     /* LDR/STR R, BaseR, offset6 */
+    ASM_TRAP,     /* TRAP trapvect8 */
+    ASM_VECTOR,   /* GETC, OUT, ... HALT */
+    ASM_RTI,
+    ASM_ORIG,
+    ASM_END,
+    ASM_FILL,
+    ASM_BLKW,
+    ASM_STRINGZ
+};
+
+struct asm_op
+{
+    char name[8];      /* zero padded, compared as one word */
+    uint8_t form;      /* ASM_ALU... */
+    uint16_t bits;     /* the opcode, or the trap vector */
+};
+
+const struct asm_op asm_ops[] =
+{
+    { "ADD", ASM_ALU, OP_ADD }, { "AND", ASM_ALU, OP_AND }, { "NOT", ASM_NOT, OP_NOT },
+    { "JMP", ASM_JMP, OP_JMP }, { "RET", ASM_RET, OP_JMP }, { "JSR", ASM_JSR, OP_JSR },
+    { "JSRR", ASM_JSRR, OP_JSR }, { "LD", ASM_PCREL, OP_LD }, { "LDI", ASM_PCREL, OP_LDI },
+    { "LEA", ASM_PCREL, OP_LEA }, { "ST", ASM_PCREL, OP_ST }, { "STI", ASM_PCREL, OP_STI },
+    { "LDR", ASM_BASE, OP_LDR }, { "STR", ASM_BASE, OP_STR }, { "TRAP", ASM_TRAP, OP_TRAP },
+    { "RTI", ASM_RTI, OP_RTI },
+    { "GETC", ASM_VECTOR, TRAP_GETC }, { "OUT", ASM_VECTOR, TRAP_OUT }, { "PUTS", ASM_VECTOR, TRAP_PUTS },
+    { "IN", ASM_VECTOR, TRAP_IN }, { "PUTSP", ASM_VECTOR, TRAP_PUTSP }, { "HALT", ASM_VECTOR, TRAP_HALT },
+    { ".ORIG", ASM_ORIG, 0 }, { ".END", ASM_END, 0 }, { ".FILL", ASM_FILL, 0 },
+    { ".BLKW", ASM_BLKW, 0 }, { ".STRINGZ", ASM_STRINGZ, 0 },
+};
+
+/* always 0, so errors can be returned in one statement */
+int asm_error(struct assembler* a, uint32_t line, const char* message, const struct asm_token* t)
+{
+    if (t)
+    {
+        fprintf(stderr, "%s:%u: %s: %.*s\n", a->path, line, message, (int)t->length, t->text);
+    }
+    else
+    {
+        fprintf(stderr, "%s:%u: %s\n", a->path, line, message);
+    }
+    return 0;
+}
+
+const struct asm_op* asm_find_op(const struct asm_token* t)
+{
+    if (t->length > 8) return NULL;
+    char upper[8] = { 0 };
+    for (uint32_t i = 0; i < t->length; ++i)
+    {
+        upper[i] = (char)toupper((unsigned char)t->text[i]);
+    }
+    uint64_t key, name;
+    memcpy(&key, upper, 8);
+    for (size_t i = 0; i < sizeof(asm_ops) / sizeof(asm_ops[0]); ++i)
+    {
+        memcpy(&name, asm_ops[i].name, 8);
+        if (key == name) return &asm_ops[i];
+    }
+    return NULL;
+}
+
+/* the nzp bits of BR, BRn, BRzp..., -1 if `t` is not one */
+int asm_branch(const struct asm_token* t)
+{
+    if (t->length < 2 || toupper((unsigned char)t->text[0]) != 'B' || toupper((unsigned char)t->text[1]) != 'R')
+    {
+        return -1;
+    }
+    int nzp = 0;
+    for (uint32_t i = 2; i < t->length; ++i)
+    {
+        int bit;
+        switch (toupper((unsigned char)t->text[i]))
+        {
+            case 'N': bit = FL_NEG; break;
+            case 'Z': bit = FL_ZRO; break;
+            case 'P': bit = FL_POS; break;
+            default: return -1;
+        }
+        if (nzp & bit) return -1;
+        nzp |= bit;
+    }
+    return nzp ? nzp : FL_NEG | FL_ZRO | FL_POS;
+}
+
+int asm_register(const struct asm_token* t)
+{
+    if (t->length == 2 && toupper((unsigned char)t->text[0]) == 'R' && t->text[1] >= '0' && t->text[1] <= '7')
+    {
+        return t->text[1] - '0';
+    }
+    return -1;
+}
+
+/* #decimal, decimal, xhex or x-hex, returns 0 if `t` is not a number */
+int asm_number(const struct asm_token* t, int32_t* value)
+{
+    const char* p = t->text;
+    const char* end = p + t->length;
+    int base = 10;
+    if (p < end && *p == '#')
+    {
+        ++p;
+    }
+    else if (p < end && (*p == 'x' || *p == 'X'))
+    {
+        ++p;
+        base = 16;
+    }
+    int negative = p < end && *p == '-';
+    if (negative) ++p;
+    if (p == end) return 0;
+
+    int32_t v = 0;
+    for (; p < end; ++p)
+    {
+        int digit = hex_digit(*p);
+        if (digit < 0 || digit >= base) return 0;
+        v = v * base + digit;
+        if (v > 0xFFFF) return 0;
+    }
+    *value = negative ? -v : v;
+    return 1;
+}
+
+uint32_t asm_hash(const char* name, uint32_t length)
+{
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < length; ++i)
+    {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* twice the slots, every symbol moved to its new place */
+int asm_grow(struct assembler* a)
+{
+    uint32_t capacity = a->capacity * 2;
+    struct asm_symbol* table = calloc(capacity, sizeof(*table));
+    if (!table) return 0;
+    for (uint32_t i = 0; i < a->capacity; ++i)
+    {
+        struct asm_symbol* s = &a->table[i];
+        if (!s->name) continue;
+        uint32_t j = s->hash & (capacity - 1);
+        while (table[j].name) j = (j + 1) & (capacity - 1);
+        table[j] = *s;
+    }
+    free(a->table);
+    a->table = table;
+    a->capacity = capacity;
+    return 1;
+}
+
+/* the symbol named `t`, added undefined if it is new, NULL if out of memory */
+struct asm_symbol* asm_symbol(struct assembler* a, const struct asm_token* t)
+{
+    if ((a->used + 1) * 2 > a->capacity && !asm_grow(a))
+    {
+        return NULL;
+    }
+    uint32_t hash = asm_hash(t->text, t->length);
+    uint32_t i = hash & (a->capacity - 1);
+    for (;; i = (i + 1) & (a->capacity - 1))
+    {
+        struct asm_symbol* s = &a->table[i];
+        if (!s->name)
+        {
+            s->name = t->text;
+            s->length = t->length;
+            s->hash = hash;
+            s->fixups = -1;
+            s->line = a->line;
+            ++a->used;
+            return s;
+        }
+        if (s->hash == hash && s->length == t->length && memcmp(s->name, t->text, t->length) == 0)
+        {
+            return s;
+        }
+    }
+}
+
+/* place `target` into the word at `address` the way `kind` says */
+int asm_patch(struct assembler* a, uint16_t address, int kind, uint16_t target, uint32_t line)
+{
+    uint16_t* memory = a->vm->memory;
+    int32_t offset = (int16_t)(target - (uint16_t)(address + 1));
+    switch (kind)
+    {
+        case ASM_OFFSET9:
+            if (offset < -256 || offset > 255) return asm_error(a, line, "label out of range of PCoffset9", NULL);
+            memory[address] |= offset & 0x1FF;
+            break;
+        case ASM_OFFSET11:
+            if (offset < -1024 || offset > 1023) return asm_error(a, line, "label out of range of PCoffset11", NULL);
+            memory[address] |= offset & 0x7FF;
+            break;
+        case ASM_WORD:
+            memory[address] = target;
+            break;
+    }
+    return 1;
+}
+
+int asm_define(struct assembler* a, const struct asm_token* t)
+{
+    struct asm_symbol* s = asm_symbol(a, t);
+    if (!s) return asm_error(a, a->line, "out of memory", NULL);
+    if (s->defined) return asm_error(a, a->line, "label defined twice", t);
+    if (!a->in_section) return asm_error(a, a->line, "label outside .ORIG", t);
+    s->defined = 1;
+    s->address = (uint16_t)a->pc;
+    for (int32_t f = s->fixups; f >= 0; f = a->fixups[f].next)
+    {
+        struct asm_fixup* x = &a->fixups[f];
+        if (!asm_patch(a, x->address, x->kind, s->address, x->line)) return 0;
+    }
+    s->fixups = -1;
+    return 1;
+}
+
+/* the operand `t` of the word about to go at a->pc, a number or a label */
+int asm_reference(struct assembler* a, const struct asm_token* t, int kind)
+{
+    int32_t value;
+    uint16_t address = (uint16_t)a->pc;
+    if (asm_number(t, &value))
+    {
+        int32_t limit = kind == ASM_OFFSET9 ? 256 : kind == ASM_OFFSET11 ? 1024 : 0;
+        if (limit && (value < -limit || value >= limit)) return asm_error(a, a->line, "offset out of range", t);
+        if (!limit && (value < -0x8000 || value > 0xFFFF)) return asm_error(a, a->line, "value out of range", t);
+        a->vm->memory[address] |= (uint16_t)value & (limit ? limit * 2 - 1 : 0xFFFF);
+        return 1;
+    }
+
+    struct asm_symbol* s = asm_symbol(a, t);
+    if (!s) return asm_error(a, a->line, "out of memory", NULL);
+    if (s->defined) return asm_patch(a, address, kind, s->address, a->line);
+
+    if (a->fixup_count == a->fixup_capacity)
+    {
+        uint32_t capacity = a->fixup_capacity ? a->fixup_capacity * 2 : 256;
+        struct asm_fixup* fixups = realloc(a->fixups, capacity * sizeof(*fixups));
+        if (!fixups) return asm_error(a, a->line, "out of memory", NULL);
+        a->fixups = fixups;
+        a->fixup_capacity = capacity;
+    }
+    struct asm_fixup* x = &a->fixups[a->fixup_count];
+    x->address = address;
+    x->kind = (uint8_t)kind;
+    x->line = a->line;
+    x->next = s->fixups;
+    s->fixups = (int32_t)a->fixup_count++;
+    return 1;
+}
+
+/* start the next word as `word`, its operands are or'ed in after */
+int asm_emit(struct assembler* a, uint16_t word)
+{
+    if (!a->in_section) return asm_error(a, a->line, "code outside .ORIG", NULL);
+    if (a->pc >= MEMORY_MAX) return asm_error(a, a->line, "runs past the end of memory", NULL);
+    a->vm->memory[a->pc] = word;
+    a->vm->decoded[a->pc].flags = 0;
+    page_dirty(a->vm, (uint16_t)a->pc);
+    return 1;
+}
+
+/*
+ * Split the line at `p` into tokens at white space and commas, up to a
+ * comment. A quoted string is one token, quotes included. Returns the
+ * count, -1 for too many or an open string.
+ */
+int asm_tokens(const char* p, const char* end, struct asm_token* tokens)
+{
+    int n = 0;
+    for (;;)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',' || *p == '\r')) ++p;
+        if (p == end || *p == ';') return n;
+        if (n == ASM_TOKENS) return -1;
+
+        const char* start = p;
+        if (*p == '"')
+        {
+            for (++p; p < end && *p != '"'; ++p)
+            {
+                if (*p == '\\' && p + 1 < end) ++p;
+            }
+            if (p == end) return -1;
+            ++p;
+        }
+        else
+        {
+            while (p < end && *p != ' ' && *p != '\t' && *p != ',' && *p != '\r' && *p != ';') ++p;
+        }
+        tokens[n].text = start;
+        tokens[n].length = (uint32_t)(p - start);
+        ++n;
+    }
+}
+
+int asm_stringz(struct assembler* a, const struct asm_token* t)
+{
+    if (t->length < 2 || t->text[0] != '"') return asm_error(a, a->line, "expected a string", t);
+    const char* p = t->text + 1;
+    const char* end = t->text + t->length - 1;
+    while (p < end)
+    {
+        uint16_t c = (uint8_t)*p++;
+        if (c == '\\')
+        {
+            switch (*p++)
+            {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case '0': c = 0; break;
+                case '\\': c = '\\'; break;
+                case '"': c = '"'; break;
+                default: return asm_error(a, a->line, "unknown escape in string", t);
+            }
+        }
+        if (!asm_emit(a, c)) return 0;
+        ++a->pc;
+    }
+    if (!asm_emit(a, 0)) return 0;
+    ++a->pc;
+    return 1;
+}
+
+/* one instruction or directive, `t` past any label */
+int asm_statement(struct assembler* a, const struct asm_op* op, int nzp, const struct asm_token* t, int n)
+{
+    static const int operands[] =
+    {
+        [ASM_ALU] = 3, [ASM_NOT] = 2, [ASM_BR] = 1, [ASM_JMP] = 1, [ASM_RET] = 0, [ASM_JSR] = 1,
+        [ASM_JSRR] = 1, [ASM_PCREL] = 2, [ASM_BASE] = 3, [ASM_TRAP] = 1, [ASM_VECTOR] = 0,
+        [ASM_RTI] = 0, [ASM_ORIG] = 1, [ASM_END] = 0, [ASM_FILL] = 1, [ASM_BLKW] = 1, [ASM_STRINGZ] = 1
+    };
+    int form = op ? op->form : ASM_BR;
+    uint16_t bits = op ? (uint16_t)(op->bits << 12) : 0;
+    if (n - 1 != operands[form]) return asm_error(a, a->line, "wrong number of operands", &t[0]);
+
+    int r[3] = { -1, -1, -1 };
+    for (int i = 1; i < n && i <= 3; ++i)
+    {
+        r[i - 1] = asm_register(&t[i]);
+    }
+
+    int32_t value;
+    switch (form)
+    {
+        case ASM_ALU:
+            if (r[0] < 0 || r[1] < 0) return asm_error(a, a->line, "expected a register", &t[r[0] < 0 ? 1 : 2]);
+            if (r[2] >= 0)
+            {
+                bits |= r[0] << 9 | r[1] << 6 | r[2];
+            }
+            else
+            {
+                if (!asm_number(&t[3], &value) || value < -16 || value > 15)
+                {
+                    return asm_error(a, a->line, "expected a register or imm5", &t[3]);
+                }
+                bits |= r[0] << 9 | r[1] << 6 | 1 << 5 | (value & 0x1F);
+            }
+            break;
+        case ASM_NOT:
+            if (r[0] < 0 || r[1] < 0) return asm_error(a, a->line, "expected a register", &t[r[0] < 0 ? 1 : 2]);
+            bits |= r[0] << 9 | r[1] << 6 | 0x3F;
+            break;
+        case ASM_BR:
+            if (!asm_emit(a, (uint16_t)(nzp << 9)) || !asm_reference(a, &t[1], ASM_OFFSET9)) return 0;
+            ++a->pc;
+            return 1;
+        case ASM_JMP:
+        case ASM_JSRR:
+            if (r[0] < 0) return asm_error(a, a->line, "expected a register", &t[1]);
+            bits |= r[0] << 6;
+            break;
+        case ASM_RET:
+            bits |= R_R7 << 6;
+            break;
+        case ASM_JSR:
+            if (!asm_emit(a, bits | 1 << 11) || !asm_reference(a, &t[1], ASM_OFFSET11)) return 0;
+            ++a->pc;
+            return 1;
+        case ASM_PCREL:
+            if (r[0] < 0) return asm_error(a, a->line, "expected a register", &t[1]);
+            if (!asm_emit(a, bits | r[0] << 9) || !asm_reference(a, &t[2], ASM_OFFSET9)) return 0;
+            ++a->pc;
+            return 1;
+        case ASM_BASE:
+            if (r[0] < 0 || r[1] < 0) return asm_error(a, a->line, "expected a register", &t[r[0] < 0 ? 1 : 2]);
+            if (!asm_number(&t[3], &value) || value < -32 || value > 31)
+            {
+                return asm_error(a, a->line, "expected offset6", &t[3]);
+            }
+            bits |= r[0] << 9 | r[1] << 6 | (value & 0x3F);
+            break;
+        case ASM_TRAP:
+            if (!asm_number(&t[1], &value) || value < 0 || value > 0xFF)
+            {
+                return asm_error(a, a->line, "expected trapvect8", &t[1]);
+            }
+            bits |= value;
+            break;
+        case ASM_VECTOR:
+            bits = (uint16_t)(OP_TRAP << 12 | op->bits);
+            break;
+        case ASM_RTI:
+            break;
+        case ASM_ORIG:
+            if (a->in_section) return asm_error(a, a->line, ".ORIG before .END", NULL);
+            if (!asm_number(&t[1], &value) || value < 0 || value > 0xFFFF)
+            {
+                return asm_error(a, a->line, "expected an address", &t[1]);
+            }
+            a->pc = (uint32_t)value;
+            a->in_section = 1;
+            a->vm->decoded[(uint16_t)(a->pc - 1)].flags = 0; /* may fuse with the first word */
+            return 1;
+        case ASM_END:
+            if (!a->in_section) return asm_error(a, a->line, ".END without .ORIG", NULL);
+            a->in_section = 0;
+            return 1;
+        case ASM_FILL:
+            if (!asm_emit(a, 0) || !asm_reference(a, &t[1], ASM_WORD)) return 0;
+            ++a->pc;
+            return 1;
+        case ASM_BLKW:
+            if (!asm_number(&t[1], &value) || value < 0) return asm_error(a, a->line, "expected a count", &t[1]);
+            for (int32_t i = 0; i < value; ++i)
+            {
+                if (!asm_emit(a, 0)) return 0;
+                ++a->pc;
+            }
+            return 1;
+        case ASM_STRINGZ:
+            return asm_stringz(a, &t[1]);
+    }
+    if (!asm_emit(a, bits)) return 0;
+    ++a->pc;
+    return 1;
+}
+
+/* assemble `size` bytes of source from `path` into `vm`, IMAGE_OK or IMAGE_ASM */
+int asm_image(struct vm* vm, const char* path, const char* src, size_t size)
+{
+    struct assembler a = { vm, path };
+    a.capacity = ASM_TABLE_MIN;
+    a.table = calloc(a.capacity, sizeof(*a.table));
+    int ok = a.table != NULL;
+    if (!ok) asm_error(&a, 0, "out of memory", NULL);
+
+    const char* p = src;
+    const char* end = src + size;
+    while (ok && p < end)
+    {
+        const char* eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) eol = end;
+        ++a.line;
+
+        struct asm_token t[ASM_TOKENS];
+        int n = asm_tokens(p, eol, t);
+        p = eol + 1;
+        if (n < 0)
+        {
+            ok = asm_error(&a, a.line, "cannot split into operands", NULL);
+            break;
+        }
+        if (n == 0) continue;
+
+        /* a first word that is not an opcode or directive is a label */
+        const struct asm_op* op = asm_find_op(&t[0]);
+        int nzp = op ? -1 : asm_branch(&t[0]);
+        struct asm_token* s = t;
+        if (!op && nzp < 0)
+        {
+            struct asm_token label = t[0];
+            if (label.length > 1 && label.text[label.length - 1] == ':') --label.length;
+            if (!(isalpha((unsigned char)label.text[0]) || label.text[0] == '_'))
+            {
+                ok = asm_error(&a, a.line, "not an opcode or label", &t[0]);
+                break;
+            }
+            ok = asm_define(&a, &label);
+            if (!ok || n == 1) continue;
+            ++s;
+            --n;
+            op = asm_find_op(s);
+            nzp = op ? -1 : asm_branch(s);
+            if (!op && nzp < 0)
+            {
+                ok = asm_error(&a, a.line, "not an opcode", s);
+                break;
+            }
+        }
+        ok = asm_statement(&a, op, nzp, s, n);
+    }
+
+    for (uint32_t i = 0; ok && i < a.capacity; ++i)
+    {
+        struct asm_symbol* sym = &a.table[i];
+        if (sym->name && !sym->defined)
+        {
+            struct asm_token name = { sym->name, sym->length };
+            ok = asm_error(&a, sym->line, "undefined label", &name);
+        }
+    }
+
+    free(a.table);
+    free(a.fixups);
+    return ok ? IMAGE_OK : IMAGE_ASM;
+}
+
+/* sources go by their extension, everything else is an image */
+int is_asm(const char* path)
+{
+    size_t n = strlen(path);
+    return n > 4 && (strcmp(path + n - 4, ".asm") == 0 || strcmp(path + n - 4, ".ASM") == 0);
+}
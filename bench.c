@@ -0,0 +1,314 @@
+/*
+ * Benchmarks. --bench runs the loaded images under every engine for the same
+ * number of instructions; --bench-suite does the same for the built-in
+ * workloads below and prints one JSON line per workload and engine. Every
+ * engine must leave the machine in the same state as the first.
+ */
+#define BENCH_INSTRUCTIONS 200000000
+#define BENCH_SUITE_INSTRUCTIONS 50000000
+#define BENCH_ENGINES 5
+/*
+ * Instructions between keys for a workload that polls: well short of the
+ * KBD_SPIN_POLLS empty polls after which kbsr_read() would sleep.
+ */
+#define BENCH_KEY_EVERY 1024
+
+struct bench_result
+{
+    const char* engine;
+    uint64_t instructions;
+    double seconds;
+    int64_t branch_misses;  /* -1 without hardware counters */
+    int same;               /* ended in the same state as the first engine */
+    int fused;              /* with superinstructions */
+    double fusion_speedup;  /* over the same engine without them, or 0 */
+};
+
+/*
+ * run the image in vm->memory under every engine, returns how many ran;
+ * with `key_every`, vm->kbd gets a key every that many instructions
+ */
+size_t bench_engines(struct vm* vm, uint64_t count, uint64_t key_every, struct bench_result* results)
+{
+    static uint16_t image[MEMORY_MAX];
+    static uint16_t first_memory[MEMORY_MAX];
+    uint16_t first_reg[R_COUNT];
+    memcpy(image, vm->memory, sizeof(image));
+
+    struct { const char* name; run_fn run; int fuse; } variants[BENCH_ENGINES] =
+    {
+        { "switch", run_switch_counted, 0 },
+        { "switch+fuse", run_switch_counted, 1 },
+#if LC3_THREADED
+        { "threaded", run_threaded_counted, 0 },
+        { "threaded+fuse", run_threaded_counted, 1 },
+#endif
+#if LC3_JIT
+        { "jit", run_jit_counted, 1 },
+#endif
+    };
+
+    int counter = branch_counter_open();
+    size_t n = 0;
+    for (; n < BENCH_ENGINES && variants[n].name; ++n)
+    {
+        vm_reset(vm);
+        memcpy(vm->memory, image, sizeof(image));
+        memset(vm->dirty, 0xFF, sizeof(vm->dirty));
+        vm->fuse = variants[n].fuse;
+        uint16_t c;
+        while (key_every && kbd_pop(vm->kbd, &c));
+
+        branch_counter_start(counter);
+        uint64_t start = clock_ns();
+        uint64_t executed = 0;
+        while (vm->running && executed < count)
+        {
+            uint64_t chunk = key_every && key_every < count - executed ? key_every : count - executed;
+            if (key_every && !kbd_full(vm->kbd))
+            {
+                kbd_push(vm->kbd, 'k');
+            }
+            vm->budget = chunk;
+            variants[n].run(vm);
+            /* a device write ends the slice early, the clock is not run here */
+            while (vm->running && vm->budget && vm->yield)
+            {
+                vm->yield = 0;
+                variants[n].run(vm);
+            }
+            executed += chunk - vm->budget;
+            if (vm->budget) break;
+        }
+        uint64_t elapsed = clock_ns() - start;
+        int64_t misses = branch_counter_read(counter);
+        sync_cond(vm);
+
+        struct bench_result* r = &results[n];
+        r->engine = variants[n].name;
+        r->instructions = executed;
+        r->seconds = elapsed / 1e9;
+        r->branch_misses = misses;
+        r->same = 1;
+        r->fused = variants[n].fuse;
+        r->fusion_speedup = 0;
+        if (r->fused && n > 0 && variants[n - 1].run == variants[n].run)
+        {
+            r->fusion_speedup = results[n - 1].seconds / r->seconds;
+        }
+        if (n == 0)
+        {
+            memcpy(first_memory, vm->memory, sizeof(first_memory));
+            memcpy(first_reg, vm->reg, sizeof(first_reg));
+        }
+        else if (memcmp(first_memory, vm->memory, sizeof(first_memory)) || memcmp(first_reg, vm->reg, sizeof(first_reg)))
+        {
+            r->same = 0;
+        }
+    }
+    branch_counter_close(counter);
+    vm->fuse = 1;
+    return n;
+}
+
+void bench(struct vm* vm, uint64_t count)
+{
+    struct bench_result results[BENCH_ENGINES];
+    size_t n = bench_engines(vm, count, 0, results);
+    for (size_t i = 0; i < n; ++i)
+    {
+        struct bench_result* r = &results[i];
+        fprintf(stderr, "%-13s %12llu instructions in %7.3f s, %8.1f MIPS",
+                r->engine, (unsigned long long)r->instructions, r->seconds,
+                r->instructions / r->seconds / 1e6);
+        if (r->branch_misses >= 0)
+        {
+            fprintf(stderr, ", %.4f branch misses per instruction",
+                    (double)r->branch_misses / r->instructions);
+        }
+        if (r->fusion_speedup > 0)
+        {
+            fprintf(stderr, ", %.2fx from fusion", r->fusion_speedup);
+        }
+        fprintf(stderr, "\n");
+        if (!r->same)
+        {
+            fprintf(stderr, "%-13s ended in a different state than %s\n", r->engine, results[0].engine);
+        }
+    }
+}
+
+/*
+ * The workloads, assembled at x3000. Each one loops forever so it runs for
+ * exactly the instructions it is given; `text` is placed after the code as
+ * a string.
+ */
+struct workload
+{
+    const char* name;
+    const uint16_t* code;
+    size_t length;
+    const char* text;
+    int polls;      /* reads the keyboard, which gets a key every BENCH_KEY_EVERY instructions */
+};
+
+/* ALU only: ADD/AND/NOT with a short inner loop */
+const uint16_t workload_alu[] =
+{
+    0x5020,         /*       AND R0, R0, #0 */
+    0x5260,         /*       AND R1, R1, #0 */
+    0x1267,         /*       ADD R1, R1, #7 */
+    0x1001,         /* LOOP  ADD R0, R0, R1 */
+    0x542F,         /*       AND R2, R0, #15 */
+    0x96BF,         /*       NOT R3, R2 */
+    0x1003,         /*       ADD R0, R0, R3 */
+    0x127F,         /*       ADD R1, R1, #-1 */
+    0x03FA,         /*       BRp LOOP */
+    0x1267,         /*       ADD R1, R1, #7 */
+    0x0FF8,         /*       BRnzp LOOP */
+};
+
+/* LDR/STR walk over a 4K word array */
+const uint16_t workload_memory[] =
+{
+    0x220B,         /* OUTER LD R1, BASE */
+    0x240B,         /*       LD R2, COUNT */
+    0x6640,         /* LOOP  LDR R3, R1, #0 */
+    0x16E1,         /*       ADD R3, R3, #1 */
+    0x7640,         /*       STR R3, R1, #0 */
+    0x6841,         /*       LDR R4, R1, #1 */
+    0x1903,         /*       ADD R4, R4, R3 */
+    0x7841,         /*       STR R4, R1, #1 */
+    0x1262,         /*       ADD R1, R1, #2 */
+    0x14BF,         /*       ADD R2, R2, #-1 */
+    0x03F7,         /*       BRp LOOP */
+    0x0FF4,         /*       BRnzp OUTER */
+    0x4000,         /* BASE  .FILL x4000 */
+    0x0800,         /* COUNT .FILL #2048 */
+};
+
+/* recursive fib(12) with the return address and arguments on a stack */
+const uint16_t workload_recursion[] =
+{
+    0x2C16,         /*       LD R6, STACK */
+    0x5020,         /* MAIN  AND R0, R0, #0 */
+    0x102C,         /*       ADD R0, R0, #12 */
+    0x4801,         /*       JSR FIB */
+    0x0FFC,         /*       BRnzp MAIN */
+    0x1DBF,         /* FIB   ADD R6, R6, #-1 */
+    0x7F80,         /*       STR R7, R6, #0 */
+    0x123E,         /*       ADD R1, R0, #-2 */
+    0x080B,         /*       BRn DONE */
+    0x1DBF,         /*       ADD R6, R6, #-1 */
+    0x7180,         /*       STR R0, R6, #0 */
+    0x103F,         /*       ADD R0, R0, #-1 */
+    0x4FF8,         /*       JSR FIB */
+    0x6380,         /*       LDR R1, R6, #0 */
+    0x7180,         /*       STR R0, R6, #0 */
+    0x107E,         /*       ADD R0, R1, #-2 */
+    0x4FF4,         /*       JSR FIB */
+    0x6380,         /*       LDR R1, R6, #0 */
+    0x1001,         /*       ADD R0, R0, R1 */
+    0x1DA1,         /*       ADD R6, R6, #1 */
+    0x6F80,         /* DONE  LDR R7, R6, #0 */
+    0x1DA1,         /*       ADD R6, R6, #1 */
+    0xC1C0,         /*       RET */
+    0xF000,         /* STACK .FILL xF000 */
+};
+
+/* PUTS and OUT in a loop, the output is thrown away */
+const uint16_t workload_output[] =
+{
+    0xE005,         /* LOOP  LEA R0, MSG */
+    0xF022,         /*       PUTS */
+    0x2002,         /*       LD R0, CH */
+    0xF021,         /*       OUT */
+    0x0FFB,         /*       BRnzp LOOP */
+    0x002E,         /* CH    .FILL x2E */
+};
+
+/* poll KBSR and read KBDR, most polls find no key and go round again */
+const uint16_t workload_polling[] =
+{
+    0xA204,         /* POLL  LDI R1, KBSR */
+    0x07FE,         /*       BRzp POLL */
+    0xA003,         /*       LDI R0, KBDR */
+    0x14A1,         /*       ADD R2, R2, #1 */
+    0x0FFB,         /*       BRnzp POLL */
+    0xFE00,         /* KBSR  .FILL xFE00 */
+    0xFE02,         /* KBDR  .FILL xFE02 */
+};
+
+#define WORKLOAD(name, text, polls) { #name, workload_##name, sizeof(workload_##name) / sizeof(uint16_t), text, polls }
+
+const struct workload workloads[] =
+{
+    WORKLOAD(alu, NULL, 0),
+    WORKLOAD(memory, NULL, 0),
+    WORKLOAD(recursion, NULL, 0),
+    WORKLOAD(output, "The quick brown fox jumps over the lazy dog", 0),
+    WORKLOAD(polling, NULL, 1),
+};
+
+int bench_suite(uint64_t count)
+{
+    static struct console discard; /* no out, so output is dropped */
+    /* open, so a poll with no key waiting is not ready */
+    static uint16_t keys[16];
+    struct kbd_fifo kbd;
+    kbd_init_empty(&kbd, keys, 16);
+
+    struct vm* vm = vm_create(&kbd, &discard);
+#if LC3_JIT
+    if (!vm || !jit_init(vm))
+#else
+    if (!vm)
+#endif
+    {
+        printf("failed to set up the benchmark\n");
+        return 1;
+    }
+
+    int status = 0;
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); ++w)
+    {
+        const struct workload* load = &workloads[w];
+        vm_reset(vm);
+        memcpy(vm->memory + PC_START, load->code, load->length * sizeof(uint16_t));
+        memset(vm->dirty, 0xFF, sizeof(vm->dirty));
+        for (size_t i = 0; load->text && load->text[i]; ++i)
+        {
+            vm->memory[PC_START + load->length + i] = (uint16_t)load->text[i];
+        }
+
+        struct bench_result results[BENCH_ENGINES];
+        size_t n = bench_engines(vm, count, load->polls ? BENCH_KEY_EVERY : 0, results);
+        for (size_t i = 0; i < n; ++i)
+        {
+            struct bench_result* r = &results[i];
+            char misses[32] = "null";
+            char speedup[32] = "null";
+            if (r->branch_misses >= 0)
+            {
+                snprintf(misses, sizeof(misses), "%lld", (long long)r->branch_misses);
+            }
+            if (r->fusion_speedup > 0)
+            {
+                snprintf(speedup, sizeof(speedup), "%.3f", r->fusion_speedup);
+            }
+            printf("{\"workload\": \"%s\", \"engine\": \"%s\", \"instructions\": %llu, \"seconds\": %.6f, "
+                   "\"mips\": %.1f, \"ns_per_instruction\": %.3f, \"branch_misses\": %s, \"same_state\": %s, "
+                   "\"fused\": %s, \"fusion_speedup\": %s}\n",
+                   load->name, r->engine, (unsigned long long)r->instructions, r->seconds,
+                   r->instructions / r->seconds / 1e6, r->seconds * 1e9 / r->instructions,
+                   misses, r->same ? "true" : "false", r->fused ? "true" : "false", speedup);
+            if (!r->same)
+            {
+                status = 1;
+            }
+        }
+    }
+    fflush(stdout);
+    vm_destroy(vm);
+    return status;
+}
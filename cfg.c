@@ -0,0 +1,270 @@
+/*
+ * Control-flow graph of the loaded program, found before it runs by
+ * following BR/JSR/JMP/TRAP from where it starts, into the guest's own
+ * trap routines too. Every word reached is decoded up front, so
+ * superinstructions are in place before the first fetch, and with the JIT
+ * on the loop headers (targets of a backward branch) are translated right
+ * away instead of after JIT_HOT entries.
+ *
+ * Targets only known at run time (JMP/JSRR through a register other than a
+ * RET) are not followed; whatever they reach is still decoded on demand.
+ */
+
+enum
+{
+    CFG_CODE = 1 << 0,   /* reached as an instruction */
+    CFG_LEADER = 1 << 1  /* starts a block */
+};
+
+enum
+{
+    CFG_TAKEN = 1 << 0,  /* ends in a branch or call to `taken` */
+    CFG_NEXT = 1 << 1,   /* falls through to `next` */
+    CFG_LOOP = 1 << 2    /* a backward branch lands here */
+};
+
+struct cfg_block
+{
+    uint16_t start;
+    uint16_t length;
+    uint16_t taken;
+    uint16_t next;
+    uint8_t flags;       /* CFG_* */
+    uint32_t entries;    /* edges into it */
+};
+
+struct cfg
+{
+    uint8_t word[MEMORY_MAX];     /* CFG_CODE/CFG_LEADER */
+    uint32_t index[MEMORY_MAX];   /* block starting at each leader */
+    uint16_t work[MEMORY_MAX];    /* leaders still to follow */
+    uint8_t page[PAGE_COUNT];     /* holds some CFG_CODE, the only pages later passes visit */
+    struct cfg_block* blocks;
+    uint32_t count;
+};
+
+/* CFG_TAKEN/CFG_NEXT for an instruction that ends a block, -1 for one that does not */
+int cfg_exits(uint16_t pc, uint16_t instr, uint16_t* target)
+{
+    unsigned op = instr >> 12;
+    switch (op)
+    {
+        case OP_BR:
+            if (!((instr >> 9) & 0x7))
+            {
+                return -1; /* never taken, not a branch at all */
+            }
+            *target = pc + 1 + sign_extend(instr & 0x1FF, 9);
+            return CFG_TAKEN | (((instr >> 9) & 0x7) == 0x7 ? 0 : CFG_NEXT);
+        case OP_JSR:
+            if ((instr >> 11) & BOOL_BITMASK)
+            {
+                *target = pc + 1 + sign_extend(instr & 0x7FF, 11);
+                return CFG_TAKEN | CFG_NEXT;
+            }
+            return CFG_NEXT;
+        case OP_TRAP:
+            return (instr & 0xFF) == TRAP_HALT ? 0 : CFG_NEXT;
+        case OP_JMP:
+        case OP_RTI:
+        case OP_RES:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+void cfg_push(struct cfg* g, uint32_t* n, uint16_t address)
+{
+    if (address < MR_IO && !(g->word[address] & CFG_LEADER))
+    {
+        g->word[address] |= CFG_LEADER;
+        g->work[(*n)++] = address;
+    }
+}
+
+/* the graph of everything reachable from `start`, NULL if out of memory */
+struct cfg* cfg_build(struct vm* vm, uint16_t start)
+{
+    struct cfg* g = calloc(1, sizeof(*g));
+    if (!g) return NULL;
+
+    /* mark every reachable word and every block start */
+    uint32_t n = 0;
+    uint32_t leaders = 0;
+    cfg_push(g, &n, start);
+    while (n)
+    {
+        uint16_t pc = g->work[--n];
+        ++leaders;
+        while (pc < MR_IO && !(g->word[pc] & CFG_CODE))
+        {
+            g->word[pc] |= CFG_CODE;
+            g->page[pc / PAGE_WORDS] = 1;
+            uint16_t target;
+            int exits = cfg_exits(pc, vm->memory[pc], &target);
+            if (exits < 0)
+            {
+                ++pc;
+                continue;
+            }
+            if (exits & CFG_TAKEN) cfg_push(g, &n, target);
+            if (exits & CFG_NEXT) cfg_push(g, &n, pc + 1);
+
+            /* a TRAP into the guest's own routine is a call to it */
+            uint16_t instr = vm->memory[pc];
+            if (instr >> 12 == OP_TRAP && vm->traps[instr & 0xFF] == trap_guest && vm->memory[instr & 0xFF])
+            {
+                cfg_push(g, &n, vm->memory[instr & 0xFF]);
+            }
+            break;
+        }
+    }
+
+    g->blocks = calloc(leaders ? leaders : 1, sizeof(*g->blocks));
+    if (!g->blocks)
+    {
+        free(g);
+        return NULL;
+    }
+
+    /* cut the marked words into blocks, in address order */
+    for (uint32_t pc = 0; pc < MR_IO; ++pc)
+    {
+        if (!g->page[pc / PAGE_WORDS])
+        {
+            pc |= PAGE_WORDS - 1;
+            continue;
+        }
+        if (!(g->word[pc] & CFG_LEADER)) continue;
+
+        struct cfg_block* b = &g->blocks[g->count];
+        g->index[pc] = g->count++;
+        b->start = (uint16_t)pc;
+        uint32_t end = pc;
+        for (;;)
+        {
+            uint16_t target;
+            int exits = cfg_exits((uint16_t)end, vm->memory[end], &target);
+            ++end;
+            if (exits >= 0)
+            {
+                b->flags = (uint8_t)exits;
+                b->taken = target;
+                break;
+            }
+            if (end >= MR_IO || !(g->word[end] & CFG_CODE))
+            {
+                break;
+            }
+            if (g->word[end] & CFG_LEADER)
+            {
+                b->flags = CFG_NEXT;
+                break;
+            }
+        }
+        b->length = (uint16_t)(end - pc);
+        b->next = (uint16_t)end;
+        if (!(b->flags & CFG_TAKEN) || b->taken >= MR_IO)
+        {
+            b->flags &= ~CFG_TAKEN;
+            b->taken = 0;
+        }
+        if (!(b->flags & CFG_NEXT) || b->next >= MR_IO)
+        {
+            b->flags &= ~CFG_NEXT;
+            b->next = 0;
+        }
+    }
+
+    for (uint32_t i = 0; i < g->count; ++i)
+    {
+        struct cfg_block* b = &g->blocks[i];
+        if (b->flags & CFG_TAKEN)
+        {
+            struct cfg_block* to = &g->blocks[g->index[b->taken]];
+            ++to->entries;
+            if (b->taken <= b->start + b->length - 1)
+            {
+                to->flags |= CFG_LOOP;
+            }
+        }
+        if (b->flags & CFG_NEXT)
+        {
+            ++g->blocks[g->index[b->next]].entries;
+        }
+    }
+    return g;
+}
+
+void cfg_free(struct cfg* g)
+{
+    free(g->blocks);
+    free(g);
+}
+
+/* decode ahead of time what `g` found, and translate its loops */
+void cfg_warm(struct vm* vm, struct cfg* g)
+{
+    for (uint32_t pc = 0; pc < MR_IO; ++pc)
+    {
+        if (!g->page[pc / PAGE_WORDS])
+        {
+            pc |= PAGE_WORDS - 1;
+            continue;
+        }
+        if (g->word[pc] & CFG_CODE)
+        {
+            fetch(vm, (uint16_t)pc);
+        }
+    }
+#if LC3_JIT
+    if (vm->jit)
+    {
+        for (uint32_t i = 0; i < g->count; ++i)
+        {
+            struct cfg_block* b = &g->blocks[i];
+            if ((b->flags & CFG_LOOP) && !vm->jit->block[b->start])
+            {
+                jit_translate(vm, b->start);
+            }
+        }
+    }
+#endif
+}
+
+/* analyze from the PC and warm the caches, returns 0 if out of memory */
+int cfg_prepare(struct vm* vm)
+{
+    struct cfg* g = cfg_build(vm, vm->reg[R_PC]);
+    if (!g) return 0;
+    cfg_warm(vm, g);
+    cfg_free(g);
+    return 1;
+}
+
+/* one line per block: its range, how many edges enter it and where it goes */
+void cfg_print(struct cfg* g, FILE* out)
+{
+    uint32_t words = 0;
+    for (uint32_t pc = 0; pc < MR_IO; ++pc)
+    {
+        if (!g->page[pc / PAGE_WORDS])
+        {
+            pc |= PAGE_WORDS - 1;
+            continue;
+        }
+        words += g->word[pc] & CFG_CODE;
+    }
+    fprintf(out, "%u blocks, %u words of code\n", g->count, words);
+
+    for (uint32_t i = 0; i < g->count; ++i)
+    {
+        struct cfg_block* b = &g->blocks[i];
+        fprintf(out, "x%04X-x%04X  entries %-4u", b->start, (uint16_t)(b->start + b->length - 1), b->entries);
+        if (b->flags & CFG_TAKEN) fprintf(out, "  taken x%04X", b->taken);
+        if (b->flags & CFG_NEXT) fprintf(out, "  next x%04X", b->next);
+        if (b->flags & CFG_LOOP) fprintf(out, "  loop");
+        fprintf(out, "\n");
+    }
+}
@@ -0,0 +1,256 @@
+/*
+ * Checkpoints hold everything needed to resume a machine elsewhere: the
+ * registers with the condition codes synced, the keys it has not read yet
+ * and memory, which includes the device registers. Memory goes in 256 word
+ * pages; pages of zeros are left out and the rest are run-length coded, so
+ * most checkpoints are a few KB. Every field is a little-endian uint16_t.
+ * Version 2 added the interrupt state; version 1 files still restore.
+ */
+#define CHECKPOINT_MAGIC "LC3C"
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_PAGE 256
+#define CHECKPOINT_PAGES (MEMORY_MAX / CHECKPOINT_PAGE)
+#define CHECKPOINT_ZEROS 0x8000 /* token for a run of (token & 0x7FFF) zero words */
+#define CHECKPOINT_KEYS_MAX 0xFFFF
+
+/*
+ * followed from version 2 by a checkpoint_machine, then by `keys` pending
+ * keys and `pages` pages, each its index and
+ * then tokens until the page is full: CHECKPOINT_ZEROS | n for n zeros,
+ * or n followed by n literal words
+ */
+struct checkpoint_header
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t reg[R_COUNT];
+    uint16_t keys;
+    uint16_t pages;
+};
+
+/* what is not in the registers or memory */
+struct checkpoint_machine
+{
+    uint16_t psr;
+    uint16_t saved_ssp;
+    uint16_t saved_usp;
+    uint16_t timer_left;       /* instructions until the timer goes off, 0 if stopped */
+};
+
+/* code one page into `out`, returns the words written */
+size_t checkpoint_page(uint16_t* out, const uint16_t* page)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < CHECKPOINT_PAGE; )
+    {
+        size_t zeros = 0;
+        while (i + zeros < CHECKPOINT_PAGE && page[i + zeros] == 0) ++zeros;
+        if (zeros >= 2 || i + zeros == CHECKPOINT_PAGE)
+        {
+            out[n++] = CHECKPOINT_ZEROS | (uint16_t)zeros;
+            i += zeros;
+            continue;
+        }
+
+        /* literals run until the next pair of zeros */
+        size_t start = i;
+        while (i < CHECKPOINT_PAGE && !(page[i] == 0 && (i + 1 == CHECKPOINT_PAGE || page[i + 1] == 0))) ++i;
+        out[n++] = (uint16_t)(i - start);
+        memcpy(out + n, page + start, (i - start) * sizeof(uint16_t));
+        n += i - start;
+    }
+    return n;
+}
+
+/*
+ * The pages as last coded, so a run saving a checkpoint every so often only
+ * codes again the pages written since: the ones in vm->dirty, and the
+ * device page, which devices change without a store.
+ */
+#define CHECKPOINT_CODED_MAX (1 + CHECKPOINT_PAGE * 2) /* the index, then at worst one literal and one zero token a word */
+
+struct checkpoint_cache
+{
+    uint16_t coded[CHECKPOINT_PAGES][CHECKPOINT_CODED_MAX];
+    uint16_t length[CHECKPOINT_PAGES]; /* words in coded[], 0 for a page of zeros */
+    uint8_t valid[CHECKPOINT_PAGES];
+};
+
+/* save `vm` to `path`, coding only what changed since `cache` was last used */
+int checkpoint_save_cached(struct vm* vm, const char* path, struct checkpoint_cache* cache)
+{
+    static uint16_t head[(sizeof(struct checkpoint_header) + 1) / 2 + sizeof(struct checkpoint_machine) / 2
+                         + CHECKPOINT_KEYS_MAX];
+    struct checkpoint_header header = { { 'L', 'C', '3', 'C' }, CHECKPOINT_VERSION };
+    sync_cond(vm);
+    memcpy(header.reg, vm->reg, sizeof(header.reg));
+
+    size_t n = (sizeof(header) + 1) / 2;
+    /*
+     * a slice can stop on the very instruction the timer is due, before
+     * run_limited() fires it; firing it here, as the next slice would,
+     * leaves it 1 to TIR instructions away, so 0 still means stopped
+     */
+    events_run(vm);
+    struct checkpoint_machine machine = { vm->psr, vm->saved_ssp, vm->saved_usp, 0 };
+    for (unsigned i = 0; i < vm->event_count; ++i)
+    {
+        if (vm->events[i].kind == EVENT_TIMER)
+        {
+            machine.timer_left = (uint16_t)(vm->events[i].when - vm->instructions);
+        }
+    }
+    memcpy(head + n, &machine, sizeof(machine));
+    n += sizeof(machine) / 2;
+
+    header.keys = (uint16_t) kbd_peek(vm->kbd, head + n, CHECKPOINT_KEYS_MAX);
+    n += header.keys;
+
+    for (size_t p = 0; p < CHECKPOINT_PAGES; ++p)
+    {
+        unsigned vp = (unsigned)(p * CHECKPOINT_PAGE / PAGE_WORDS);
+        int changed = !cache->valid[p] || ((vm->dirty[vp / 64] >> (vp % 64)) & 1) || p * CHECKPOINT_PAGE >= MR_IO;
+        if (changed)
+        {
+            const uint16_t* page = vm->memory + p * CHECKPOINT_PAGE;
+            size_t i = page_populated(vm, vp) ? 0 : CHECKPOINT_PAGE;
+            while (i < CHECKPOINT_PAGE && page[i] == 0) ++i;
+            cache->length[p] = 0;
+            if (i < CHECKPOINT_PAGE)
+            {
+                cache->coded[p][0] = (uint16_t) p;
+                cache->length[p] = (uint16_t)(1 + checkpoint_page(cache->coded[p] + 1, page));
+            }
+            cache->valid[p] = 1;
+        }
+        header.pages += cache->length[p] != 0;
+    }
+    memcpy(head, &header, sizeof(header));
+    pages_clean(vm);
+
+    /* written next to `path` and renamed over it, so a run killed while saving leaves the last one */
+    char part[4096];
+    if (snprintf(part, sizeof(part), "%s.part", path) >= (int)sizeof(part))
+    {
+        return 0;
+    }
+    FILE* file = fopen(part, "wb");
+    if (!file)
+    {
+        return 0;
+    }
+    int ok = fwrite(head, sizeof(uint16_t), n, file) == n;
+    for (size_t p = 0; p < CHECKPOINT_PAGES && ok; ++p)
+    {
+        ok = fwrite(cache->coded[p], sizeof(uint16_t), cache->length[p], file) == cache->length[p];
+    }
+    ok = fclose(file) == 0 && ok && rename(part, path) == 0;
+    if (!ok)
+    {
+        remove(part);
+    }
+    return ok;
+}
+
+int checkpoint_save(struct vm* vm, const char* path)
+{
+    static struct checkpoint_cache cache;
+    memset(cache.valid, 0, sizeof(cache.valid));
+    return checkpoint_save_cached(vm, path, &cache);
+}
+
+/* replace the state of `vm` with the checkpoint at `path`, IMAGE_* */
+int checkpoint_restore(struct vm* vm, const char* path)
+{
+    size_t size;
+    const uint8_t* data = map_file(path, &size);
+    if (!data)
+    {
+        return IMAGE_UNREADABLE;
+    }
+
+    struct checkpoint_header header;
+    size_t n = (sizeof(header) + 1) / 2;
+    if (size < n * 2 || memcmp(data, CHECKPOINT_MAGIC, 4) != 0)
+    {
+        unmap_file(data, size);
+        return size < 4 ? IMAGE_TRUNCATED : IMAGE_UNREADABLE;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    const uint16_t* in = (const uint16_t*)data;
+    size_t count = size / 2;
+    struct checkpoint_machine machine = { PSR_USER, SSP_START, 0, 0 };
+    size_t extra = header.version >= 2 ? sizeof(machine) / 2 : 0;
+    if (extra && count - n >= extra)
+    {
+        memcpy(&machine, in + n, sizeof(machine));
+    }
+    int result = header.version >= 1 && header.version <= CHECKPOINT_VERSION && count - n >= extra + header.keys
+                 ? IMAGE_OK : IMAGE_TRUNCATED;
+    n += extra;
+    const uint16_t* keys = in + n;
+    n += header.keys;
+
+    vm_reset(vm);
+    for (unsigned p = 0; p < header.pages && result == IMAGE_OK; ++p)
+    {
+        if (n >= count || in[n] >= CHECKPOINT_PAGES)
+        {
+            result = IMAGE_TRUNCATED;
+            break;
+        }
+        uint16_t origin = (uint16_t)(in[n++] * CHECKPOINT_PAGE);
+        pages_mark(vm, origin, CHECKPOINT_PAGE);
+        uint16_t* page = vm->memory + origin;
+        /* vm_reset() left pages that were never written decoded as zeros */
+        memset(vm->decoded + origin, 0, CHECKPOINT_PAGE * sizeof(*vm->decoded));
+        vm->decoded[(uint16_t)(origin - 1)].flags = 0; /* may have fused with the first word */
+        size_t i = 0;
+        while (i < CHECKPOINT_PAGE)
+        {
+            if (n >= count)
+            {
+                result = IMAGE_TRUNCATED;
+                break;
+            }
+            uint16_t token = in[n++];
+            size_t len = token & ~CHECKPOINT_ZEROS;
+            if (len > CHECKPOINT_PAGE - i || (!(token & CHECKPOINT_ZEROS) && len > count - n))
+            {
+                result = IMAGE_TRUNCATED;
+                break;
+            }
+            if (!(token & CHECKPOINT_ZEROS))
+            {
+                memcpy(page + i, in + n, len * sizeof(uint16_t));
+                n += len;
+            }
+            i += len;
+        }
+    }
+
+    if (result == IMAGE_OK)
+    {
+        memcpy(vm->reg, header.reg, sizeof(vm->reg));
+        load_cond(vm);
+        vm->psr = machine.psr & (PSR_USER | PSR_PRIORITY);
+        vm->saved_ssp = machine.saved_ssp;
+        vm->saved_usp = machine.saved_usp;
+        interrupts_update(vm);
+        if (machine.timer_left)
+        {
+            event_push(vm, vm->instructions + machine.timer_left, EVENT_TIMER);
+        }
+        for (unsigned i = 0; i < header.keys && !kbd_full(vm->kbd); ++i)
+        {
+            kbd_push(vm->kbd, keys[i]);
+        }
+    }
+    else
+    {
+        vm_reset(vm);
+    }
+    unmap_file(data, size);
+    return result;
+}
@@ -0,0 +1,17 @@
+/*
+ * Edge coverage of the guest for the fuzzer, see fuzz.c. run_coverage
+ * counts every pair of consecutive blocks the way AFL does, by the start of
+ * each, into counters libFuzzer reads after every input alongside the ones
+ * it keeps for the host code.
+ */
+#define COVERAGE_EDGES MEMORY_MAX
+
+__attribute__((section("__libfuzzer_extra_counters")))
+uint8_t coverage_counters[COVERAGE_EDGES];
+uint16_t coverage_last;  /* the previous block's start, shifted so A->B and B->A differ */
+
+static inline void coverage_edge(uint16_t block)
+{
+    ++coverage_counters[(uint16_t)(block ^ coverage_last)];
+    coverage_last = block >> 1;
+}
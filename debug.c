@@ -0,0 +1,72 @@
+/*
+ * Breakpoints for the run_debug interpreter, a bit per word. Only run_debug
+ * looks at them, and only while some are set, so the other engines run
+ * exactly as they would without a debugger. Write watchpoints are
+ * HOOK_WATCH store hooks, which every engine's stores already test for.
+ * See gdb.c for what sets them.
+ */
+enum
+{
+    DEBUG_NONE,
+    DEBUG_BREAK,       /* about to run a breakpoint */
+    DEBUG_WATCH,       /* the last instruction wrote a watched word */
+    DEBUG_INTERRUPT    /* the debugger asked to stop */
+};
+
+struct debug
+{
+    uint64_t breaks[MEMORY_MAX / 64];
+    unsigned armed;      /* breakpoints set */
+    int skip;            /* let the next instruction run even if it is a breakpoint */
+    int stop;            /* DEBUG_*, why run_debug() stopped */
+    int watched;         /* a watched word is being written, stop after this instruction */
+    uint16_t watch_address;
+};
+
+static inline int debug_test(const uint64_t* bits, uint16_t address)
+{
+    return (bits[address >> 6] >> (address & 63)) & 1;
+}
+
+/* set or clear the breakpoint at `address`, returns 0 if it already was */
+int debug_set(struct debug* g, uint16_t address, int on)
+{
+    if (debug_test(g->breaks, address) == on) return 0;
+    g->breaks[address >> 6] ^= (uint64_t)1 << (address & 63);
+    g->armed += on ? 1 : -1;
+    return 1;
+}
+
+/* the on_watch of a debugged VM: stop once the store's instruction is done */
+void debug_watched(struct vm* vm, uint16_t address, uint16_t val)
+{
+    vm->debug->watched = 1;
+    vm->debug->watch_address = address;
+}
+
+/*
+ * Called by run_debug with the instruction at PC - 1 fetched but not run
+ * yet, returns 1 to stop before it.
+ */
+int debug_step(struct vm* vm)
+{
+    struct debug* g = vm->debug;
+    int skip = g->skip;
+    g->skip = 0;
+    if (g->watched)
+    {
+        g->watched = 0;
+        g->stop = DEBUG_WATCH;
+        return 1;
+    }
+    if (!g->armed)
+    {
+        return 0;
+    }
+    if (!skip && debug_test(g->breaks, vm->reg[R_PC] - 1))
+    {
+        g->stop = DEBUG_BREAK;
+        return 1;
+    }
+    return 0;
+}
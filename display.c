@@ -0,0 +1,149 @@
+/*
+ * A character display the guest draws on by storing to memory. With
+ * DCR (xFE12) bit 15 set, the DISPLAY_COLUMNS x DISPLAY_ROWS words from the
+ * address in DBR (xFE10) are the screen, row by row: the low byte of a word
+ * is its character, the high byte its colors, foreground in bits 8-11 and
+ * background in bits 12-15. A color of 0 is the terminal's default, 1-8 are
+ * black to white and 9-15 bright red to bright white.
+ *
+ * The grid is plain RAM, so drawing costs the guest nothing more than a
+ * store. The host looks at it from run_limited() a fixed number of times a
+ * second and whenever the guest waits for a key, compares it with what the
+ * terminal was last sent and sends the cells that changed, with their
+ * cursor moves and colors, in one write.
+ */
+#define DISPLAY_COLUMNS 80
+#define DISPLAY_ROWS 24
+#define DISPLAY_CELLS (DISPLAY_COLUMNS * DISPLAY_ROWS)
+#define DISPLAY_FPS 30
+#define DISPLAY_SLICE (1 << 18) /* instructions between looks at the clock */
+
+struct display
+{
+    FILE* out;
+    uint64_t interval;        /* ns between frames */
+    uint64_t next;            /* clock_ns() of the next frame */
+    int on;                   /* the terminal shows the grid */
+    uint16_t shown[DISPLAY_CELLS];
+    char frame[DISPLAY_CELLS * 32 + 64]; /* enough for a cursor move and both colors a cell */
+};
+
+/* a display writing to `out` at `fps` frames a second, NULL if out of memory */
+struct display* display_create(FILE* out, unsigned fps)
+{
+    struct display* s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    s->out = out;
+    s->interval = 1000000000 / (fps ? fps : 1);
+    return s;
+}
+
+/* the SGR parameter for color `c` of a nibble, `base` 30 for foreground, 40 for background */
+int display_color(unsigned c, int base)
+{
+    if (c == 0) return base + 9;
+    if (c <= 8) return base + (int)c - 1;
+    return base + 60 + (int)c - 8;
+}
+
+/* send the cells that changed since the last frame */
+void display_frame(struct vm* vm)
+{
+    struct display* s = vm->display;
+    char* buf = s->frame;
+    size_t n = 0;
+    if (!(vm->memory[MR_DCR] & (1 << 15)))
+    {
+        if (!s->on) return;
+        /* leave the picture, but give the terminal its cursor back below it */
+        s->on = 0;
+        n += (size_t)sprintf(buf, "\x1b[0m\x1b[%d;1H\x1b[?25h", DISPLAY_ROWS + 1);
+    }
+    else
+    {
+        if (!s->on)
+        {
+            s->on = 1;
+            /* a cleared screen shows zeros: blanks in the default colors */
+            memset(s->shown, 0, sizeof(s->shown));
+            n += (size_t)sprintf(buf, "\x1b[?25l\x1b[0m\x1b[2J");
+        }
+
+        uint16_t base = vm->memory[MR_DBR];
+        int row = -1, column = -1;
+        int colors = -1;
+        for (int i = 0; i < DISPLAY_CELLS; ++i)
+        {
+            uint16_t a = (uint16_t)(base + i);
+            uint16_t cell = a < MR_IO ? vm->memory[a] : 0;
+            if (cell == s->shown[i]) continue;
+            s->shown[i] = cell;
+
+            int r = i / DISPLAY_COLUMNS, c = i % DISPLAY_COLUMNS;
+            if (r != row || c != column)
+            {
+                n += (size_t)sprintf(buf + n, "\x1b[%d;%dH", r + 1, c + 1);
+            }
+            if (cell >> 8 != colors)
+            {
+                colors = cell >> 8;
+                n += (size_t)sprintf(buf + n, "\x1b[%d;%dm", display_color(colors & 0xF, 30), display_color(colors >> 4, 40));
+            }
+            char ch = (char)(cell & 0xFF);
+            buf[n++] = ch >= 0x20 && ch < 0x7F ? ch : ' ';
+            row = r;
+            column = c + 1;
+        }
+        if (colors > 0)
+        {
+            n += (size_t)sprintf(buf + n, "\x1b[0m");
+        }
+    }
+    if (n)
+    {
+        /* what the guest printed before comes first */
+        console_flush(vm->console);
+        fwrite(buf, 1, n, s->out);
+        fflush(s->out);
+    }
+}
+
+/* called between slices, draws a frame once it is time for one */
+void display_tick(struct vm* vm)
+{
+    struct display* s = vm->display;
+    uint64_t now = clock_ns();
+    if (now >= s->next)
+    {
+        display_frame(vm);
+        s->next = now + s->interval;
+    }
+}
+
+/* the guest is about to wait for a key, so what it drew should be seen now */
+static inline void display_idle(struct vm* vm)
+{
+    if (vm->display)
+    {
+        display_frame(vm);
+    }
+}
+
+/* the last frame, and the cursor back, once the run is over */
+void display_end(struct vm* vm)
+{
+    display_frame(vm);
+    if (vm->display->on)
+    {
+        fprintf(vm->display->out, "\x1b[0m\x1b[%d;1H\x1b[?25h", DISPLAY_ROWS + 1);
+        fflush(vm->display->out);
+    }
+}
+
+/* on Ctrl-C, so the terminal gets its cursor back */
+struct vm* display_vm;
+
+void display_interrupted()
+{
+    display_end(display_vm);
+}
@@ -0,0 +1,159 @@
+/*
+ * A libFuzzer harness for guest programs, built in place of main():
+ *
+ *     clang -O2 -g -fsanitize=fuzzer,address -DLC3_FUZZ -o lc3-fuzz lc3.c
+ *     LC3_FUZZ_IMAGES=os.obj,program.obj ./lc3-fuzz corpus/
+ *
+ * The images are loaded once. Every input then runs in the same process on
+ * the same VM, put back first by copying only the pages the last input
+ * wrote from a copy taken after loading, which costs a few microseconds
+ * rather than an exec. An OP_RES or a bad RTI aborts, which libFuzzer
+ * reports as a crash with the input that caused it; a guest that does not
+ * halt just runs out of instructions. Set in the environment:
+ *
+ *   LC3_FUZZ_IMAGES        the images, as for --preload
+ *   LC3_FUZZ_TRAPS         native, guest or auto, as for --traps
+ *   LC3_FUZZ_INSTRUCTIONS  the budget of one input, 100000 by default
+ *   LC3_FUZZ_MEMORY        an address like x4000: the input starts with a
+ *                          word count and that many words to put there
+ *
+ * Whatever is left of the input is typed, a byte a key, and after it the
+ * keyboard reaches end of file. Output goes nowhere.
+ */
+#define FUZZ_INSTRUCTIONS 100000
+#define FUZZ_KEYS_MAX 65536
+
+struct fuzz_base
+{
+    uint16_t memory[MEMORY_MAX];
+    struct decoded decoded[MEMORY_MAX];
+    uint16_t reg[R_COUNT];
+    uint64_t populated[PAGE_MAP_WORDS];
+};
+
+struct vm* fuzz_vm;
+struct fuzz_base* fuzz_base;
+struct kbd_fifo fuzz_kbd;
+struct console fuzz_console;  /* no file, drops the output */
+uint16_t fuzz_keys[FUZZ_KEYS_MAX];
+uint64_t fuzz_instructions = FUZZ_INSTRUCTIONS;
+int fuzz_memory = -1;         /* where LC3_FUZZ_MEMORY puts words, -1 for nowhere */
+
+/* back to just after loading, copying only the pages written since */
+void fuzz_reset(struct vm* vm, const struct fuzz_base* base)
+{
+    for (unsigned p = 0; p < PAGE_COUNT; ++p)
+    {
+        /* devices write their registers without marking the page */
+        if (!(vm->dirty[p / 64] >> (p % 64) & 1) && p < MR_IO / PAGE_WORDS) continue;
+        size_t word = p * PAGE_WORDS;
+        memcpy(vm->memory + word, base->memory + word, PAGE_WORDS * sizeof(*vm->memory));
+        memcpy(vm->decoded + word, base->decoded + word, PAGE_WORDS * sizeof(*vm->decoded));
+        vm->decoded[(uint16_t)(word - 1)].flags = 0; /* may have fused with the first word */
+    }
+    memset(vm->dirty, 0, sizeof(vm->dirty));
+    memcpy(vm->populated, base->populated, sizeof(vm->populated));
+
+    memcpy(vm->reg, base->reg, sizeof(vm->reg));
+    load_cond(vm);
+    vm->kbd_empty_polls = 0;
+    vm->running = 1;
+    vm->instructions = 0;
+    interrupts_reset(vm);
+    coverage_last = 0;
+}
+
+int LLVMFuzzerInitialize(int* argc, char*** argv)
+{
+    const char* images = getenv("LC3_FUZZ_IMAGES");
+    if (!images)
+    {
+        fprintf(stderr, "set LC3_FUZZ_IMAGES to the images to fuzz\n");
+        exit(2);
+    }
+    int traps = TRAPS_NATIVE;
+    const char* value = getenv("LC3_FUZZ_TRAPS");
+    if (value)
+    {
+        for (traps = 0; traps <= TRAPS_AUTO && strcmp(value, trap_modes[traps]) != 0; ++traps);
+        if (traps > TRAPS_AUTO)
+        {
+            fprintf(stderr, "unknown trap mode: %s\n", value);
+            exit(2);
+        }
+    }
+    value = getenv("LC3_FUZZ_INSTRUCTIONS");
+    if (value)
+    {
+        fuzz_instructions = strtoull(value, NULL, 10);
+    }
+    value = getenv("LC3_FUZZ_MEMORY");
+    if (value)
+    {
+        if (*value == 'x' || *value == 'X') ++value;
+        fuzz_memory = (int)(strtoul(value, NULL, 16) & 0xFFFF);
+    }
+
+    devices_init();
+    kbd_init_keys(&fuzz_kbd, fuzz_keys, 0);
+    fuzz_vm = vm_create(&fuzz_kbd, &fuzz_console);
+    fuzz_base = malloc(sizeof(*fuzz_base));
+    if (!fuzz_vm || !fuzz_base)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    int result = read_images(fuzz_vm, images, 0);
+    if (result != IMAGE_OK)
+    {
+        fprintf(stderr, "failed to load image: %s %s\n", images, image_errors[result]);
+        exit(1);
+    }
+    set_traps(fuzz_vm, traps);
+    if (!cfg_prepare(fuzz_vm))
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    /* what fuzz_reset() goes back to, with the decode cache already warm */
+    struct vm* vm = fuzz_vm;
+    pages_clean(vm);
+    sync_cond(vm);
+    memcpy(fuzz_base->memory, vm->memory, sizeof(fuzz_base->memory));
+    memcpy(fuzz_base->decoded, vm->decoded, sizeof(fuzz_base->decoded));
+    memcpy(fuzz_base->reg, vm->reg, sizeof(fuzz_base->reg));
+    memcpy(fuzz_base->populated, vm->populated, sizeof(fuzz_base->populated));
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    struct vm* vm = fuzz_vm;
+    fuzz_reset(vm, fuzz_base);
+
+    if (fuzz_memory >= 0 && size >= 2)
+    {
+        /* laid out like an image whose origin is the word count */
+        struct image_header h = { (uint16_t)fuzz_memory, (size_t)(data[0] << 8 | data[1]), 0 };
+        if (h.count > (size - 2) / 2) h.count = (size - 2) / 2;
+        size_t room = h.origin < MR_IO ? (size_t)(MR_IO - h.origin) : 0;
+        if (h.count > room) h.count = room;
+        image_place(vm, data, &h);
+        pages_mark(vm, h.origin, h.count);
+        vm->decoded[(uint16_t)(h.origin - 1)].flags = 0;
+        data += 2 + h.count * 2;
+        size -= 2 + h.count * 2;
+    }
+
+    unsigned count = size < FUZZ_KEYS_MAX ? (unsigned)size : FUZZ_KEYS_MAX;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        fuzz_keys[i] = data[i];
+    }
+    kbd_init_keys(&fuzz_kbd, fuzz_keys, count);
+
+    uint64_t executed;
+    run_limited(vm, run_coverage, fuzz_instructions, UINT64_MAX, &executed);
+    return 0;
+}
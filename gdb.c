@@ -0,0 +1,460 @@
+/*
+ * A GDB remote serial protocol stub: --gdb=port (or a Unix socket path)
+ * waits for one debugger and runs the guest under run_debug while it
+ * stays connected. The target has ten 16-bit registers, R0-R7, PC and the
+ * PSR with the condition codes, described to GDB in target.xml.
+ * Addresses are byte addresses: word N is at 2N, low byte first. Z0/Z1
+ * set breakpoints and Z2 write watchpoints; continuing checks for a ^C
+ * every GDB_SLICE instructions.
+ */
+#define GDB_PACKET_MAX 4096
+#define GDB_SLICE (1 << 16)
+#define GDB_REGISTERS (R_COND + 1) /* R0-R7, PC and the PSR */
+
+enum
+{
+    GDB_HALTED,    /* the guest halted, or the debugger killed it */
+    GDB_DETACHED,  /* the debugger went away and the guest runs on */
+    GDB_FAILED     /* no debugger could connect */
+};
+
+struct gdb
+{
+    int fd;
+    struct vm* vm;
+    struct debug debug;
+    char packet[GDB_PACKET_MAX + 1];
+    char reply[GDB_PACKET_MAX + 1];
+    char in[GDB_PACKET_MAX];   /* read from the socket, not consumed yet */
+    long in_size;
+    long in_next;
+};
+
+const char gdb_target_xml[] =
+    "<?xml version=\"1.0\"?>\n"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+    "<target version=\"1.0\">\n"
+    "  <feature name=\"org.lc3.core\">\n"
+    "    <reg name=\"r0\" bitsize=\"16\" type=\"int\"/>\n"
+    "    <reg name=\"r1\" bitsize=\"16\" type=\"int\"/>\n"
+    "    <reg name=\"r2\" bitsize=\"16\" type=\"int\"/>\n"
+    "    <reg name=\"r3\" bitsize=\"16\" type=\"int\"/>\n"
+    "    <reg name=\"r4\" bitsize=\"16\" type=\"int\"/>\n"
+    "    <reg name=\"r5\" bitsize=\"16\" type=\"int\"/>\n"
+    "    <reg name=\"r6\" bitsize=\"16\" type=\"data_ptr\"/>\n"
+    "    <reg name=\"r7\" bitsize=\"16\" type=\"code_ptr\"/>\n"
+    "    <reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>\n"
+    "    <reg name=\"psr\" bitsize=\"16\" type=\"int\"/>\n"
+    "  </feature>\n"
+    "</target>\n";
+
+/* the next byte from the debugger, -1 once it has gone */
+int gdb_getc(struct gdb* g)
+{
+    if (g->in_next == g->in_size)
+    {
+        g->in_size = socket_read(g->fd, g->in, sizeof(g->in));
+        g->in_next = 0;
+        if (g->in_size <= 0)
+        {
+            g->in_size = 0;
+            return -1;
+        }
+    }
+    return (uint8_t)g->in[g->in_next++];
+}
+
+/* read the next $packet#xx into g->packet and acknowledge it, 0 once the debugger has gone */
+int gdb_receive(struct gdb* g)
+{
+    for (;;)
+    {
+        int c;
+        while ((c = gdb_getc(g)) != '$')
+        {
+            if (c < 0) return 0;
+        }
+
+        size_t n = 0;
+        uint8_t sum = 0;
+        while ((c = gdb_getc(g)) != '#')
+        {
+            if (c < 0) return 0;
+            if (n < GDB_PACKET_MAX) g->packet[n++] = (char)c;
+            sum += (uint8_t)c;
+        }
+        g->packet[n] = '\0';
+        int hi = hex_digit((char)gdb_getc(g));
+        int lo = hex_digit((char)gdb_getc(g));
+        int ok = hi >= 0 && lo >= 0 && (hi << 4 | lo) == sum;
+        if (!socket_write(g->fd, ok ? "+" : "-", 1)) return 0;
+        if (ok) return 1;
+    }
+}
+
+int gdb_send(struct gdb* g, const char* s)
+{
+    static const char digits[] = "0123456789abcdef";
+    char frame[GDB_PACKET_MAX + 4];
+    size_t n = strlen(s);
+    uint8_t sum = 0;
+    frame[0] = '$';
+    for (size_t i = 0; i < n; ++i)
+    {
+        frame[i + 1] = s[i];
+        sum += (uint8_t)s[i];
+    }
+    frame[n + 1] = '#';
+    frame[n + 2] = digits[sum >> 4];
+    frame[n + 3] = digits[sum & 0xF];
+    return socket_write(g->fd, frame, n + 4);
+}
+
+/* `value` as 4 hex digits, low byte first */
+char* gdb_put_word(char* out, uint16_t value)
+{
+    sprintf(out, "%02x%02x", value & 0xFF, value >> 8);
+    return out + 4;
+}
+
+/* 4 hex digits, low byte first, at `*p`; -1 if they are not there */
+int gdb_get_word(const char** p)
+{
+    int value = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        int digit = hex_digit((*p)[i]);
+        if (digit < 0) return -1;
+        value |= digit << (i & 1 ? 0 : 4) << (i < 2 ? 0 : 8);
+    }
+    *p += 4;
+    return value;
+}
+
+/* a hex number at `*p`, stopping at the first non-digit */
+uint32_t gdb_get_hex(const char** p)
+{
+    uint32_t value = 0;
+    while (hex_digit(**p) >= 0)
+    {
+        value = value << 4 | (uint32_t)hex_digit(*(*p)++);
+    }
+    return value;
+}
+
+uint16_t gdb_register(struct vm* vm, int r)
+{
+    return r == R_COND ? psr_read(vm, MR_PSR) : vm->reg[r];
+}
+
+void gdb_set_register(struct vm* vm, int r, uint16_t value)
+{
+    if (r == R_COND)
+    {
+        psr_write(vm, MR_PSR, value);
+    }
+    else
+    {
+        vm->reg[r] = value;
+    }
+}
+
+/* bytes of memory without the side effects of reading a device register */
+void gdb_read_memory(struct gdb* g, uint32_t address, uint32_t length)
+{
+    char* out = g->reply;
+    if (length > GDB_PACKET_MAX / 2) length = GDB_PACKET_MAX / 2;
+    for (uint32_t a = address; a < address + length && a < 2 * MEMORY_MAX; ++a)
+    {
+        uint16_t word = g->vm->memory[a >> 1];
+        out += sprintf(out, "%02x", (a & 1 ? word >> 8 : word) & 0xFF);
+    }
+    *out = '\0';
+    if (out == g->reply) strcpy(g->reply, "E01");
+}
+
+/*
+ * write the bytes in hex at `p`, doing what mem_write() does for RAM but
+ * for the watchpoints, which are there for the guest's stores only
+ */
+int gdb_write_memory(struct gdb* g, uint32_t address, uint32_t length, const char* p)
+{
+    struct vm* vm = g->vm;
+    for (uint32_t a = address; a < address + length; ++a, p += 2)
+    {
+        int hi = hex_digit(p[0]);
+        int lo = hi >= 0 ? hex_digit(p[1]) : -1;
+        if (lo < 0 || a >= 2 * MEMORY_MAX) return 0;
+        uint16_t w = (uint16_t)(a >> 1);
+        uint16_t word = a & 1 ? (uint16_t)((vm->memory[w] & 0x00FF) | (hi << 4 | lo) << 8)
+                              : (uint16_t)((vm->memory[w] & 0xFF00) | (hi << 4 | lo));
+        vm->memory[w] = word;
+        if (w < MR_IO)
+        {
+            page_dirty(vm, w);
+            vm->decoded[w].flags = 0;
+            vm->decoded[(uint16_t)(w - 1)].flags = 0;
+#if LC3_JIT
+            if (vm->store_hooks[w] & HOOK_JIT) vm->jit_stale = 1;
+#endif
+        }
+    }
+    return 1;
+}
+
+/* Z/z: `on` to insert, the type, address and length are at `p` */
+void gdb_point(struct gdb* g, const char* p, int on)
+{
+    char type = *p++;
+    if (*p++ != ',')
+    {
+        strcpy(g->reply, "E01");
+        return;
+    }
+    uint32_t address = gdb_get_hex(&p);
+    uint32_t length = *p == ',' ? (++p, gdb_get_hex(&p)) : 1;
+    if (address >= 2 * MEMORY_MAX)
+    {
+        strcpy(g->reply, "E01");
+        return;
+    }
+
+    struct debug* d = &g->debug;
+    if (type == '0' || type == '1')
+    {
+        debug_set(d, (uint16_t)(address >> 1), on);
+    }
+    else if (type == '2')
+    {
+        uint32_t last = address + (length ? length : 1) - 1;
+        for (uint32_t w = address >> 1; w <= last >> 1 && w < MEMORY_MAX; ++w)
+        {
+            if (!watch_word(g->vm, (uint16_t)w, on, debug_watched))
+            {
+                strcpy(g->reply, "E02");
+                return;
+            }
+        }
+    }
+    else
+    {
+        g->reply[0] = '\0'; /* read and access watchpoints are not supported */
+        return;
+    }
+    strcpy(g->reply, "OK");
+}
+
+/* the debugger sent ^C while the guest was running */
+int gdb_interrupted(struct gdb* g)
+{
+    while (g->in_next < g->in_size || socket_ready(g->fd))
+    {
+        int c = gdb_getc(g);
+        if (c < 0 || c == 0x03) return 1;
+    }
+    return 0;
+}
+
+/* run from the current PC, one instruction if `step`, and put the stop reply in g->reply */
+void gdb_resume(struct gdb* g, int step)
+{
+    struct vm* vm = g->vm;
+    struct debug* d = &g->debug;
+    d->stop = DEBUG_NONE;
+    d->skip = 1; /* the breakpoint we stopped at, if any, is not hit again */
+    for (;;)
+    {
+        uint64_t executed;
+        run_limited(vm, run_debug, step ? 1 : GDB_SLICE, UINT64_MAX, &executed);
+        if (!vm->running || d->stop || step) break;
+        if (gdb_interrupted(g))
+        {
+            d->stop = DEBUG_INTERRUPT;
+            break;
+        }
+    }
+    if (step && d->watched)
+    {
+        d->watched = 0;
+        d->stop = DEBUG_WATCH;
+    }
+    sync_cond(vm);
+    console_flush(vm->console);
+
+    if (!vm->running)
+    {
+        strcpy(g->reply, "W00");
+    }
+    else if (d->stop == DEBUG_WATCH)
+    {
+        sprintf(g->reply, "T05watch:%x;", 2u * d->watch_address);
+    }
+    else
+    {
+        strcpy(g->reply, d->stop == DEBUG_INTERRUPT ? "S02" : "S05");
+    }
+}
+
+/* qXfer:features:read:target.xml:offset,length */
+void gdb_features(struct gdb* g, const char* p)
+{
+    uint32_t offset = gdb_get_hex(&p);
+    uint32_t length = *p == ',' ? (++p, gdb_get_hex(&p)) : 0;
+    uint32_t size = sizeof(gdb_target_xml) - 1;
+    if (offset > size)
+    {
+        strcpy(g->reply, "E01");
+        return;
+    }
+    if (length > GDB_PACKET_MAX - 1) length = GDB_PACKET_MAX - 1;
+    if (length > size - offset) length = size - offset;
+    g->reply[0] = offset + length < size ? 'm' : 'l';
+    memcpy(g->reply + 1, gdb_target_xml + offset, length);
+    g->reply[length + 1] = '\0';
+}
+
+/* answer one packet, returns GDB_HALTED or GDB_DETACHED once the session is over, -1 otherwise */
+int gdb_handle(struct gdb* g)
+{
+    struct vm* vm = g->vm;
+    const char* p = g->packet + 1;
+    char* out = g->reply;
+    *out = '\0';
+    switch (g->packet[0])
+    {
+        case '?':
+            strcpy(out, "S05");
+            break;
+        case 'g':
+            for (int r = 0; r < GDB_REGISTERS; ++r)
+            {
+                out = gdb_put_word(out, gdb_register(vm, r));
+            }
+            break;
+        case 'G':
+        {
+            int values[GDB_REGISTERS];
+            int r = 0;
+            while (r < GDB_REGISTERS && (values[r] = gdb_get_word(&p)) >= 0) ++r;
+            if (r < GDB_REGISTERS)
+            {
+                strcpy(out, "E01");
+                break;
+            }
+            for (r = 0; r < GDB_REGISTERS; ++r)
+            {
+                gdb_set_register(vm, r, (uint16_t)values[r]);
+            }
+            strcpy(out, "OK");
+            break;
+        }
+        case 'p':
+        {
+            uint32_t r = gdb_get_hex(&p);
+            if (r < GDB_REGISTERS) gdb_put_word(out, gdb_register(vm, (int)r));
+            else strcpy(out, "E01");
+            break;
+        }
+        case 'P':
+        {
+            uint32_t r = gdb_get_hex(&p);
+            int value = *p == '=' ? (++p, gdb_get_word(&p)) : -1;
+            if (r < GDB_REGISTERS && value >= 0)
+            {
+                gdb_set_register(vm, (int)r, (uint16_t)value);
+                strcpy(out, "OK");
+            }
+            else
+            {
+                strcpy(out, "E01");
+            }
+            break;
+        }
+        case 'm':
+        {
+            uint32_t address = gdb_get_hex(&p);
+            uint32_t length = *p == ',' ? (++p, gdb_get_hex(&p)) : 0;
+            gdb_read_memory(g, address, length);
+            break;
+        }
+        case 'M':
+        {
+            uint32_t address = gdb_get_hex(&p);
+            uint32_t length = *p == ',' ? (++p, gdb_get_hex(&p)) : 0;
+            int ok = *p++ == ':' && strlen(p) >= 2 * (size_t)length && gdb_write_memory(g, address, length, p);
+            strcpy(out, ok ? "OK" : "E01");
+            break;
+        }
+        case 'Z':
+        case 'z':
+            gdb_point(g, p, g->packet[0] == 'Z');
+            break;
+        case 'c':
+        case 's':
+            if (*p)
+            {
+                vm->reg[R_PC] = (uint16_t)(gdb_get_hex(&p) >> 1);
+            }
+            gdb_resume(g, g->packet[0] == 's');
+            if (!vm->running)
+            {
+                gdb_send(g, g->reply);
+                return GDB_HALTED;
+            }
+            break;
+        case 'k':
+            vm->running = 0;
+            return GDB_HALTED;
+        case 'D':
+            gdb_send(g, "OK");
+            return GDB_DETACHED;
+        case 'H':
+        case 'T':
+            strcpy(out, "OK");
+            break;
+        case 'q':
+            if (strncmp(p, "Supported", 9) == 0)
+            {
+                sprintf(out, "PacketSize=%x;qXfer:features:read+", GDB_PACKET_MAX);
+            }
+            else if (strncmp(p, "Xfer:features:read:target.xml:", 30) == 0)
+            {
+                gdb_features(g, p + 30);
+            }
+            else if (strcmp(p, "Attached") == 0)
+            {
+                strcpy(out, "1");
+            }
+            break;
+    }
+    gdb_send(g, g->reply);
+    return -1;
+}
+
+/* debug `vm` from whoever connects to `where`, GDB_* */
+int gdb_serve(struct vm* vm, const char* where)
+{
+    struct gdb* g = calloc(1, sizeof(*g));
+    if (!g) return GDB_FAILED;
+    fprintf(stderr, "waiting for the debugger on %s\n", where);
+    g->fd = socket_accept_one(where);
+    if (g->fd < 0)
+    {
+        free(g);
+        return GDB_FAILED;
+    }
+    g->vm = vm;
+    vm->debug = &g->debug;
+
+    int result;
+    do
+    {
+        result = gdb_receive(g) ? gdb_handle(g) : GDB_DETACHED;
+    } while (result < 0);
+
+    store_hooks_clear(vm, HOOK_WATCH);
+    vm->debug = NULL;
+    socket_close(g->fd);
+    free(g);
+    return result;
+}
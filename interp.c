@@ -0,0 +1,455 @@
+/*
+ * The opcode handlers, written once and included by lc3.c for every
+ * interpreter it needs. Define before including:
+ *
+ *   INTERP_NAME      name of the generated function
+ *   INTERP_THREADED  1 to dispatch with computed goto, 0 for the switch
+ *   INTERP_BUDGET    1 to stop after `budget` instructions
+ *   INTERP_BLOCKS    1 to count them a block at a time, and stop early
+ *                    once the end of the budget is near, see run_counted()
+ *   INTERP_JIT       1 to hand hot blocks to the JIT
+ *   INTERP_PROFILE   1 to count every instruction in vm->profile
+ *   INTERP_TRACE     1 to record every instruction in vm->trace
+ *   INTERP_DEBUG     1 to stop at the breakpoints and watchpoints in vm->debug
+ *   INTERP_COVERAGE  1 to count the edges between blocks, see coverage.c
+ *
+ * The profiler, the tracer and the debugger see every instruction, so they
+ * run superinstructions as their first instruction alone.
+ *
+ * R0-R7, the PC and the condition value are locals for the whole slice,
+ * which memory[] and the calls out cannot alias, so the compiler keeps
+ * them in registers. They are written back to vm->reg with SPILL() before
+ * anything that looks at vm->reg or may change it, and read again with
+ * RELOAD() after: traps, RTI, interrupts, device registers, the JIT, the
+ * profiler, the tracer, the debugger and the end of the slice.
+ */
+
+#define INTERP_FUSE (!INTERP_PROFILE && !INTERP_TRACE && !INTERP_DEBUG)
+
+#if INTERP_FUSE
+#define OPCODE(d) (d)->op
+#else
+#define OPCODE(d) (d)->base
+#endif
+
+#if INTERP_BLOCKS
+/*
+ * Straight-line code runs through consecutive words, so a block costs the
+ * words from its start `block` to the PC after its last instruction. With
+ * more than BLOCKS_TAIL left no block can overrun the budget.
+ */
+#define TICK()
+#define FUSED(n)
+#define END() left -= (uint16_t)(pc - block)
+#define STARTED() block = pc; if (left <= BLOCKS_TAIL) goto stop
+#elif INTERP_BUDGET
+#define TICK() if (--left == 0) goto stop
+/* a superinstruction runs `n` more, or only its first if the budget ends sooner */
+#define FUSED(n) do { if (left <= (n)) DISPATCH(d->base); left -= (n); } while (0)
+#define END()
+#define STARTED()
+#else
+#define TICK()
+#define FUSED(n)
+#define END()
+#define STARTED()
+#endif
+
+#define SPILL() do { memcpy(vm->reg, reg, sizeof(reg)); vm->reg[R_PC] = pc; vm->cond_value = cond; } while (0)
+#define RELOAD() do { memcpy(reg, vm->reg, sizeof(reg)); pc = vm->reg[R_PC]; cond = vm->cond_value; } while (0)
+
+/* instructions that set the flags leave the value they wrote, see update_flags() */
+#define FLAGS(r) cond = reg[r]
+
+/* loads and stores through an address that may be a device register, PSR reads and writes the flags */
+#define LOAD(out, address) \
+    do { \
+        uint16_t at = (address); \
+        if (at < MR_IO) (out) = memory[at]; \
+        else { SPILL(); uint16_t v = io_read(vm, at); RELOAD(); (out) = v; } \
+    } while (0)
+#define STORE(address, val) \
+    do { \
+        uint16_t at = (address); \
+        if (at < MR_IO) mem_write(vm, at, (val)); \
+        else { SPILL(); io_write(vm, at, (val)); RELOAD(); } \
+    } while (0)
+
+/* control just reached the start of a block, the place to take interrupts */
+#if INTERP_BUDGET
+#define INTERRUPT() \
+    if (vm->irq_enabled) \
+    { \
+        SPILL(); \
+        int waiting = interrupt_check(vm, d); \
+        RELOAD(); \
+        if (waiting) goto stop; \
+    }
+#else
+#define INTERRUPT()
+#endif
+
+#if INTERP_JIT && INTERP_BUDGET
+#define BLOCK() \
+    do { \
+        INTERRUPT(); \
+        vm->jit->fuel = left - 1; \
+        SPILL(); \
+        jit_dispatch(vm); \
+        RELOAD(); \
+        left = vm->jit->fuel + 1; \
+        STARTED(); \
+        if (vm->yield) goto stop; \
+    } while (0)
+#elif INTERP_JIT
+#define BLOCK() do { SPILL(); jit_dispatch(vm); RELOAD(); if (vm->yield) goto stop; } while (0)
+#elif INTERP_COVERAGE
+#define BLOCK() do { INTERRUPT(); coverage_edge(pc); STARTED(); } while (0)
+#else
+#define BLOCK() do { INTERRUPT(); STARTED(); } while (0)
+#endif
+
+#if INTERP_PROFILE
+#define PROFILE() do { SPILL(); profile_step(vm, pc - 1, d); } while (0)
+#elif INTERP_TRACE
+#define PROFILE() do { SPILL(); trace_step(vm, pc - 1, d); } while (0)
+#elif INTERP_DEBUG
+/* back to before the fetch, the instruction has not run */
+#define PROFILE() do { SPILL(); if (debug_step(vm)) { --pc; ++left; goto stop; } } while (0)
+#else
+#define PROFILE()
+#endif
+
+/* a bad instruction ends the process, or for an embedded VM the run */
+#define FAULT() do { SPILL(); console_flush(vm->console); if (!vm_fault(vm)) abort(); goto stop; } while (0)
+
+#if INTERP_THREADED
+#define HANDLER(op) L_##op:
+#define DISPATCH(op) goto *dispatch[op]
+#define NEXT \
+    do { \
+        TICK(); \
+        d = fetch(vm, pc++); \
+        PROFILE(); \
+        DISPATCH(OPCODE(d)); \
+    } while (0)
+#else
+#define HANDLER(op) case op:
+#define DISPATCH(o) do { op = (o); goto again; } while (0)
+#define NEXT break
+#endif
+
+void INTERP_NAME(struct vm* vm)
+{
+    uint16_t reg[R_R7 + 1];
+    uint16_t pc;
+    uint16_t cond;
+    RELOAD();
+    uint16_t* memory = vm->memory;
+    struct decoded* d;
+#if INTERP_BUDGET
+    uint64_t left = vm->budget + 1;
+#endif
+#if INTERP_BLOCKS
+    uint16_t block;
+    STARTED();
+#endif
+
+#if INTERP_THREADED
+    static const void* const dispatch[OP_FUSED_COUNT] =
+    {
+        &&L_OP_BR, &&L_OP_ADD, &&L_OP_LD, &&L_OP_ST,
+        &&L_OP_JSR, &&L_OP_AND, &&L_OP_LDR, &&L_OP_STR,
+        &&L_OP_RTI, &&L_OP_NOT, &&L_OP_LDI, &&L_OP_STI,
+        &&L_OP_JMP, &&L_OP_RES, &&L_OP_LEA, &&L_OP_TRAP,
+        &&L_OP_LD_IO, &&L_OP_ST_IO,
+        &&L_OP_CONST, &&L_OP_PUSH, &&L_OP_POP, &&L_OP_ADD_BR
+    };
+
+    NEXT;
+#else
+    unsigned op;
+    for (;;)
+    {
+        TICK();
+        /* FETCH */
+        d = fetch(vm, pc++);
+        PROFILE();
+        op = OPCODE(d);
+
+#if INTERP_BUDGET && !INTERP_BLOCKS
+again:
+#endif
+        switch (op)
+        {
+#endif
+            HANDLER(OP_ADD)
+                {
+                    if (d->flags & DEC_IMM)
+                    {
+                        reg[d->r0] = reg[d->r1] + d->imm;
+                    }
+                    else
+                    {
+                        reg[d->r0] = reg[d->r1] + reg[d->r2];
+                    }
+
+                    FLAGS(d->r0);
+                }
+                NEXT;
+
+            HANDLER(OP_AND)
+                {
+                    if (d->flags & DEC_IMM)
+                    {
+                        reg[d->r0] = reg[d->r1] & d->imm;
+                    }
+                    else
+                    {
+                        reg[d->r0] = reg[d->r1] & reg[d->r2];
+                    }
+
+                    FLAGS(d->r0);
+                }
+                NEXT;
+            HANDLER(OP_NOT)
+                {
+                    reg[d->r0] = ~reg[d->r1];
+
+                    FLAGS(d->r0);
+                }
+                NEXT;
+            HANDLER(OP_BR)
+                {
+                    END();
+                    /* d->r0 holds the nzp bits in the same order as FL_* */
+                    if (d->r0 & flags_of(cond))
+                    {
+                        pc += d->imm;
+                    }
+                    BLOCK();
+                }
+                NEXT;
+            HANDLER(OP_JMP)
+                {
+                    END();
+                    pc = reg[d->r1];
+                    BLOCK();
+                }
+
+                NEXT;
+            HANDLER(OP_JSR)
+                {
+                    END();
+                    reg[R_R7] = pc;
+                    if (!(d->flags & DEC_IMM))
+                    {
+                        pc = reg[d->r1];
+                    }
+                    else
+                    {
+                        pc = d->imm + reg[R_R7];
+                    }
+                    BLOCK();
+                }
+
+                NEXT;
+            HANDLER(OP_LD)
+                {
+                    reg[d->r0] = memory[(uint16_t)(pc + d->imm)];
+                    FLAGS(d->r0);
+                }
+
+                NEXT;
+            HANDLER(OP_LD_IO)
+                {
+                    SPILL();
+                    uint16_t v = io_read(vm, pc + d->imm);
+                    RELOAD();
+                    reg[d->r0] = v;
+                    FLAGS(d->r0);
+                }
+
+                NEXT;
+            HANDLER(OP_LDI)
+                {
+                    uint16_t address;
+                    LOAD(address, pc + d->imm);
+                    LOAD(reg[d->r0], address);
+                    FLAGS(d->r0);
+                }
+                NEXT;
+
+            HANDLER(OP_LDR)
+                {
+                    LOAD(reg[d->r0], reg[d->r1] + d->imm);
+                    FLAGS(d->r0);
+                }
+
+                NEXT;
+            HANDLER(OP_LEA)
+                {
+                    reg[d->r0] = pc + d->imm;
+                    FLAGS(d->r0);
+                }
+
+                NEXT;
+            HANDLER(OP_ST)
+                {
+                    mem_write(vm, pc + d->imm, reg[d->r0]);
+                }
+
+                NEXT;
+            HANDLER(OP_ST_IO)
+                {
+                    SPILL();
+                    io_write(vm, pc + d->imm, reg[d->r0]);
+                    RELOAD();
+                    if (vm->yield)
+                    {
+                        END();
+                        goto stop;
+                    }
+                }
+
+                NEXT;
+            HANDLER(OP_STI)
+                {
+                    uint16_t address;
+                    LOAD(address, pc + d->imm);
+                    STORE(address, reg[d->r0]);
+                    if (vm->yield)
+                    {
+                        END();
+                        goto stop;
+                    }
+                }
+
+                NEXT;
+            HANDLER(OP_STR)
+                {
+                    STORE(reg[d->r1] + d->imm, reg[d->r0]);
+                    /* through a base register it may be MCR, or a register that ends the slice */
+                    if (vm->yield)
+                    {
+                        END();
+                        goto stop;
+                    }
+                }
+
+                NEXT;
+            HANDLER(OP_TRAP)
+                {
+                    END();
+                    SPILL();
+                    trap(vm, d->imm);
+                    RELOAD();
+                    if (vm->yield) goto stop;
+                    BLOCK();
+                }
+                NEXT;
+            HANDLER(OP_CONST)
+                {
+                    FUSED(1);
+                    reg[d->r0] = d->imm2;
+                    FLAGS(d->r0);
+                    ++pc;
+                }
+                NEXT;
+            HANDLER(OP_PUSH)
+                {
+                    FUSED(1);
+                    reg[d->r0] = reg[d->r1] + d->imm;
+                    FLAGS(d->r0);
+                    ++pc;
+                    STORE(reg[d->r0] + d->imm2, reg[d->r2]);
+                    if (vm->yield)
+                    {
+                        END();
+                        goto stop;
+                    }
+                }
+                NEXT;
+            HANDLER(OP_POP)
+                {
+                    FUSED(1);
+                    LOAD(reg[d->r0], reg[d->r1] + d->imm);
+                    reg[d->r1] += d->imm2;
+                    FLAGS(d->r1);
+                    ++pc;
+                }
+                NEXT;
+            HANDLER(OP_ADD_BR)
+                {
+                    FUSED(1);
+                    reg[d->r0] = reg[d->r1] + d->imm;
+                    FLAGS(d->r0);
+                    ++pc;
+                    END();
+                    if (d->r2 & flags_of(cond))
+                    {
+                        pc += d->imm2;
+                    }
+                    BLOCK();
+                }
+                NEXT;
+            HANDLER(OP_RTI)
+                {
+                    END();
+                    SPILL();
+                    int handled = rti(vm);
+                    RELOAD();
+                    if (!handled)
+                    {
+                        FAULT();
+                    }
+                    BLOCK();
+                }
+                NEXT;
+            HANDLER(OP_RES)
+#if !INTERP_THREADED
+            default:
+#endif
+                END();
+                FAULT();
+                NEXT;
+#if !INTERP_THREADED
+        }
+    }
+#endif
+
+stop:
+    SPILL();
+#if INTERP_BUDGET
+    vm->budget = left ? left - 1 : 0;
+#endif
+    return;
+}
+
+#undef BLOCK
+#undef SPILL
+#undef RELOAD
+#undef FLAGS
+#undef LOAD
+#undef STORE
+#undef INTERRUPT
+#undef TICK
+#undef END
+#undef STARTED
+#undef FUSED
+#undef OPCODE
+#undef DISPATCH
+#undef PROFILE
+#undef FAULT
+#undef HANDLER
+#undef NEXT
+#undef INTERP_NAME
+#undef INTERP_THREADED
+#undef INTERP_BUDGET
+#undef INTERP_BLOCKS
+#undef INTERP_JIT
+#undef INTERP_PROFILE
+#undef INTERP_TRACE
+#undef INTERP_DEBUG
+#undef INTERP_COVERAGE
+#undef INTERP_FUSE
@@ -0,0 +1,307 @@
+/*
+ * Interrupts, the way the LC-3 takes them: a device with its interrupt
+ * enable bit (14) and ready bit (15) set, at a priority above the PSR's,
+ * makes the machine push PSR and PC on the supervisor stack and jump
+ * through the interrupt vector table at x0100. RTI undoes it.
+ *
+ * They are checked at block boundaries only, and only while some device
+ * has interrupts enabled, so code that never enables them pays for one
+ * predictable branch per block.
+ *
+ * Time is counted in instructions. Timed device work is queued as events
+ * in a min-heap on vm->instructions; run_limited() ends each slice at the
+ * next one. A guest that waits for an interrupt in a BR to itself is not
+ * run instruction by instruction: the clock skips to the next event, or
+ * the host sleeps until a key arrives.
+ */
+#define PSR_USER (1 << 15)
+#define PSR_PRIORITY 0x0700
+#define SSP_START 0x3000 /* the supervisor stack grows down from below user space */
+
+enum
+{
+    INT_PRIVILEGE = 0x00, /* RTI in user mode */
+    INT_KBD = 0x80,
+    INT_TIMER = 0x81
+};
+
+enum
+{
+    PL_KBD = 4,
+    PL_TIMER = 5
+};
+
+/* set from the enable bits whenever the guest writes them */
+void interrupts_update(struct vm* vm)
+{
+    vm->irq_enabled = (vm->memory[MR_KBSR] | vm->memory[MR_TSR]) & (1 << 14);
+}
+
+/* the power-on state: user mode at priority 0, nothing queued or scripted */
+void interrupts_reset(struct vm* vm)
+{
+    vm->psr = PSR_USER;
+    vm->saved_ssp = SSP_START;
+    vm->saved_usp = 0;
+    vm->event_count = 0;
+    vm->script = NULL;
+    vm->idle = 0;
+    vm->yield = 0;
+    vm->timer_dirty = 0;
+    interrupts_update(vm);
+}
+
+void event_swap(struct event* a, struct event* b)
+{
+    struct event t = *a;
+    *a = *b;
+    *b = t;
+}
+
+void event_push(struct vm* vm, uint64_t when, int kind)
+{
+    if (vm->event_count == EVENTS_MAX) return;
+    unsigned i = vm->event_count++;
+    vm->events[i].when = when;
+    vm->events[i].kind = kind;
+    while (i && vm->events[(i - 1) / 2].when > vm->events[i].when)
+    {
+        event_swap(&vm->events[(i - 1) / 2], &vm->events[i]);
+        i = (i - 1) / 2;
+    }
+}
+
+/* take out the event at `i` */
+void event_remove(struct vm* vm, unsigned i)
+{
+    struct event* e = vm->events;
+    e[i] = e[--vm->event_count];
+    unsigned n = vm->event_count;
+    while (i && e[(i - 1) / 2].when > e[i].when)
+    {
+        event_swap(&e[(i - 1) / 2], &e[i]);
+        i = (i - 1) / 2;
+    }
+    for (;;)
+    {
+        unsigned least = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && e[l].when < e[least].when) least = l;
+        if (r < n && e[r].when < e[least].when) least = r;
+        if (least == i) break;
+        event_swap(&e[least], &e[i]);
+        i = least;
+    }
+}
+
+void event_cancel(struct vm* vm, int kind)
+{
+    for (unsigned i = 0; i < vm->event_count; )
+    {
+        if (vm->events[i].kind == kind)
+        {
+            event_remove(vm, i);
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
+
+/*
+ * The timer: writing TIR starts it going off every TIR instructions, zero
+ * stops it. Each time sets TSR bit 15, which reading TSR clears, and with
+ * bit 14 set interrupts at PL_TIMER.
+ */
+uint16_t tsr_read(struct vm* vm, uint16_t address)
+{
+    uint16_t status = vm->memory[MR_TSR];
+    vm->memory[MR_TSR] &= ~(1 << 15);
+    return status;
+}
+
+void tsr_write(struct vm* vm, uint16_t address, uint16_t val)
+{
+    vm->memory[MR_TSR] = (vm->memory[MR_TSR] & (1 << 15)) | (val & (1 << 14));
+    interrupts_update(vm);
+}
+
+/* the clock is only exact between slices, so run_limited() starts it, see devices_sync() */
+void tir_write(struct vm* vm, uint16_t address, uint16_t val)
+{
+    vm->memory[MR_TIR] = val;
+    vm->timer_dirty = 1;
+    vm->yield = 1;
+}
+
+/* bit 15 is the keyboard's, the guest only sets the enable bit */
+void kbsr_write(struct vm* vm, uint16_t address, uint16_t val)
+{
+    vm->memory[MR_KBSR] = (vm->memory[MR_KBSR] & (1 << 15)) | (val & (1 << 14));
+    interrupts_update(vm);
+}
+
+uint16_t psr_read(struct vm* vm, uint16_t address)
+{
+    return vm->psr | cond_flags(vm);
+}
+
+void psr_write(struct vm* vm, uint16_t address, uint16_t val)
+{
+    vm->psr = val & (PSR_USER | PSR_PRIORITY);
+    vm->reg[R_COND] = val & 0x7;
+    load_cond(vm);
+}
+
+/* work a device asked for that needs the exact clock */
+void devices_sync(struct vm* vm)
+{
+    if (vm->timer_dirty)
+    {
+        vm->timer_dirty = 0;
+        event_cancel(vm, EVENT_TIMER);
+        if (vm->memory[MR_TIR])
+        {
+            event_push(vm, vm->instructions + vm->memory[MR_TIR], EVENT_TIMER);
+        }
+    }
+}
+
+void script_fire(struct vm* vm); /* in script.c */
+
+/* fire every event that is due */
+void events_run(struct vm* vm)
+{
+    while (vm->event_count && vm->events[0].when <= vm->instructions)
+    {
+        struct event e = vm->events[0];
+        event_remove(vm, 0);
+        switch (e.kind)
+        {
+            case EVENT_TIMER:
+                vm->memory[MR_TSR] |= 1 << 15;
+                if (vm->memory[MR_TIR])
+                {
+                    event_push(vm, e.when + vm->memory[MR_TIR], EVENT_TIMER);
+                }
+                break;
+            case EVENT_KEY:
+                script_fire(vm);
+                break;
+        }
+    }
+}
+
+/* switch to the supervisor stack and run the handler for `vector` at `priority` */
+void interrupt_enter(struct vm* vm, uint16_t vector, uint16_t priority)
+{
+    uint16_t* reg = vm->reg;
+    uint16_t psr = vm->psr | cond_flags(vm);
+    if (vm->psr & PSR_USER)
+    {
+        vm->saved_usp = reg[R_R6];
+        reg[R_R6] = vm->saved_ssp;
+    }
+    mem_write(vm, --reg[R_R6], psr);
+    mem_write(vm, --reg[R_R6], reg[R_PC]);
+    /* the flags have no all-clear state here, so they are left as they were */
+    vm->psr = priority << 8;
+    reg[R_PC] = mem_read(vm, 0x0100 + vector);
+}
+
+/* returns 0 if there is nothing to handle an RTI in user mode */
+int rti(struct vm* vm)
+{
+    uint16_t* reg = vm->reg;
+    if (vm->psr & PSR_USER)
+    {
+        if (!vm->memory[0x0100 + INT_PRIVILEGE]) return 0;
+        interrupt_enter(vm, INT_PRIVILEGE, (vm->psr & PSR_PRIORITY) >> 8);
+        return 1;
+    }
+    reg[R_PC] = mem_read(vm, reg[R_R6]++);
+    psr_write(vm, MR_PSR, mem_read(vm, reg[R_R6]++));
+    if (vm->psr & PSR_USER)
+    {
+        vm->saved_ssp = reg[R_R6];
+        reg[R_R6] = vm->saved_usp;
+    }
+    return 1;
+}
+
+/* the device that should interrupt now, returns its priority or 0 */
+int interrupt_request(struct vm* vm, uint16_t* vector)
+{
+    uint16_t* memory = vm->memory;
+    int current = (vm->psr & PSR_PRIORITY) >> 8;
+    if ((memory[MR_TSR] & 0xC000) == 0xC000 && PL_TIMER > current)
+    {
+        *vector = INT_TIMER;
+        return PL_TIMER;
+    }
+    if ((memory[MR_KBSR] & (1 << 14)) && PL_KBD > current)
+    {
+        /* latch a key like kbsr_read() would, but end of file never interrupts */
+        uint16_t c;
+        if (!(memory[MR_KBSR] & (1 << 15)) && kbd_peek(vm->kbd, &c, 1) && kbd_pop(vm->kbd, &c))
+        {
+            memory[MR_KBSR] |= 1 << 15;
+            memory[MR_KBDR] = c;
+        }
+        if (memory[MR_KBSR] & (1 << 15))
+        {
+            *vector = INT_KBD;
+            return PL_KBD;
+        }
+    }
+    return 0;
+}
+
+/*
+ * At the end of block `d` with interrupts enabled: take one if a device is
+ * asking, returns 1 if instead the guest is waiting in a BR to itself for
+ * something that can still happen, or kbsr_read() found it waiting for a
+ * key, so the slice should end.
+ */
+int interrupt_check(struct vm* vm, struct decoded* d)
+{
+    if (vm->idle)
+    {
+        return 1; /* an embedded guest polling for a key that is not there */
+    }
+    uint16_t vector;
+    int priority = interrupt_request(vm, &vector);
+    if (priority)
+    {
+        interrupt_enter(vm, vector, (uint16_t)priority);
+        return 0;
+    }
+    if (d->op == OP_BR && d == &vm->decoded[vm->reg[R_PC]]
+        && (vm->event_count || ((vm->memory[MR_KBSR] & (1 << 14)) && kbd_empty(vm->kbd))))
+    {
+        vm->idle = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * The guest is idle: skip the clock to the next event, at most `max`
+ * instructions, or with none queued wait a little for a key. Returns the
+ * instructions skipped, which count as run.
+ */
+uint64_t interrupt_wait(struct vm* vm, uint64_t max)
+{
+    vm->idle = 0;
+    if (vm->event_count)
+    {
+        uint64_t skip = vm->events[0].when - vm->instructions;
+        if (skip > max) skip = max;
+        vm->instructions += skip;
+        return skip;
+    }
+    console_flush_for_input(vm->console);
+    display_idle(vm);
+    input_wait(vm->kbd, KBD_SPIN_WAIT_MS);
+    return 0;
+}
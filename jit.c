@@ -0,0 +1,546 @@
+/*
+ * Basic-block JIT for x86-64.
+ *
+ * The interpreter counts entries into each block (code reached by BR, JMP,
+ * JSR or TRAP) and once a block is hot it is translated into native code.
+ * Every VM has its own translations. rbx points at the VM, whose reg[] and
+ * cond_value come first, memory[] is addressed through r12 and r13 points
+ * at the fuel, the instructions native code may still execute.
+ *
+ * A block ends at the first BR/JMP/JSR, and before any TRAP, RTI/RES or
+ * access to a device register at a known address; those are left to the
+ * interpreter. Exits to a known address are chained to the target block once
+ * it is translated, exits through a register look the target up in
+ * block[]. Translated words carry HOOK_JIT, so a store that hits one sets
+ * vm->jit_stale, the running block leaves at the next instruction and
+ * everything is thrown away.
+ */
+
+
+#define JIT_CODE_SIZE (4 << 20)
+#define JIT_HOT 64           /* entries before a block is translated */
+#define JIT_BLOCK_LEN 128    /* instructions per block */
+#define JIT_BLOCK_BYTES (JIT_BLOCK_LEN * 96 + 64)
+
+/* byte offsets from rbx, both fit a disp8 */
+#define JIT_REG(r) (offsetof(struct vm, reg) + (r) * 2)
+#define JIT_COND offsetof(struct vm, cond_value)
+
+/* exits waiting for their target to be translated */
+struct jit_link
+{
+    uint32_t at;        /* rel32 of the jmp to patch */
+    uint16_t target;
+};
+
+/* fuel to give back for instructions a block skips by leaving early */
+struct jit_refund
+{
+    uint8_t* at;
+    uint32_t executed;
+};
+
+struct jit
+{
+    uint8_t* code;
+    size_t used;
+    size_t base;        /* end of the entry and exit stubs */
+    size_t exit;
+    void (*entry)(struct vm* vm, uint16_t* memory, int64_t* fuel, void* code);
+    int64_t fuel;
+    int64_t held;       /* fuel jit_leave() took away */
+    int native;         /* native code is running */
+    void* block[MEMORY_MAX];
+    uint16_t heat[MEMORY_MAX];
+
+    struct jit_link* links;
+    size_t link_count;
+    size_t link_max;
+
+    /* state of the block being translated */
+    uint8_t* p;
+    int flag_reg;
+    struct jit_refund refunds[JIT_BLOCK_LEN];
+    int refund_count;
+};
+
+void emit8(struct jit* j, uint8_t b) { *j->p++ = b; }
+void emit16(struct jit* j, uint16_t w) { memcpy(j->p, &w, 2); j->p += 2; }
+void emit32(struct jit* j, uint32_t w) { memcpy(j->p, &w, 4); j->p += 4; }
+void emit64(struct jit* j, uint64_t w) { memcpy(j->p, &w, 8); j->p += 8; }
+
+void emit_rel32(struct jit* j, uint8_t* target)
+{
+    emit32(j, (uint32_t)(target - (j->p + 4)));
+}
+
+void patch_rel32(uint8_t* at, uint8_t* target)
+{
+    uint32_t rel = (uint32_t)(target - (at + 4));
+    memcpy(at, &rel, 4);
+}
+
+/* movzx <eax|ecx|edx|esi>, word [rbx + reg] */
+void emit_load_reg(struct jit* j, uint8_t host, uint16_t r)
+{
+    emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0x43 | host << 3); emit8(j, JIT_REG(r));
+}
+
+/* mov word [rbx + reg], ax */
+void emit_store_reg(struct jit* j, uint16_t r)
+{
+    emit8(j, 0x66); emit8(j, 0x89); emit8(j, 0x43); emit8(j, JIT_REG(r));
+}
+
+/* mov word [rbx + reg], imm16 */
+void emit_store_reg_imm(struct jit* j, uint16_t r, uint16_t imm)
+{
+    emit8(j, 0x66); emit8(j, 0xC7); emit8(j, 0x43); emit8(j, JIT_REG(r)); emit16(j, imm);
+}
+
+/* call fn(vm, ...), the vm is the first argument */
+void emit_call(struct jit* j, void* fn)
+{
+    emit8(j, 0x48); emit8(j, 0x89); emit8(j, 0xDF);                  /* mov rdi, rbx */
+    emit8(j, 0x48); emit8(j, 0xB8); emit64(j, (uint64_t)(uintptr_t)fn); /* mov rax, fn */
+    emit8(j, 0xFF); emit8(j, 0xD0);                                  /* call rax */
+}
+
+/*
+ * Only ADD/AND/NOT/LD/LDI/LDR/LEA write registers inside a block and they
+ * all set the flags, so cond_value is simply the last destination and only
+ * needs storing when the block leaves or branches.
+ */
+
+/* cond_value = reg[flag_reg], leaves the value in eax */
+void emit_sync_flags(struct jit* j)
+{
+    if (j->flag_reg >= 0)
+    {
+        emit_load_reg(j, 0, j->flag_reg);
+        emit8(j, 0x66); emit8(j, 0x89); emit8(j, 0x43); emit8(j, JIT_COND); /* mov [rbx + cond], ax */
+    }
+}
+
+/* x86 condition code for each nzp mask after test ax, ax */
+const uint8_t jit_branch_cc[8] =
+{
+    0x0,
+    0xF, /* p: jg */
+    0x4, /* z: jz */
+    0x9, /* zp: jns */
+    0x8, /* n: js */
+    0x5, /* np: jnz */
+    0xE, /* nz: jle */
+    0x0,
+};
+
+/* eax = memory[eax], the device page goes through io_read() */
+void emit_read(struct jit* j)
+{
+    emit8(j, 0x3D); emit32(j, MR_IO);               /* cmp eax, MR_IO */
+    emit8(j, 0x72); emit8(j, 19);                   /* jb fast */
+    emit8(j, 0x89); emit8(j, 0xC6);                 /* mov esi, eax */
+    emit_call(j, io_read);                          /* 15 bytes */
+    emit8(j, 0xEB); emit8(j, 5);                    /* jmp done */
+    emit8(j, 0x41); emit8(j, 0x0F); emit8(j, 0xB7); /* fast: movzx eax, word [r12 + rax*2] */
+    emit8(j, 0x04); emit8(j, 0x44);
+}
+
+/* eax = memory[address] for an address known not to be a device */
+void emit_read_abs(struct jit* j, uint16_t address)
+{
+    emit8(j, 0x41); emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0x84); emit8(j, 0x24);
+    emit32(j, address * 2);
+}
+
+void emit_exit_pc(struct jit* j, uint16_t pc)
+{
+    emit_store_reg_imm(j, R_PC, pc);
+    emit8(j, 0xE9); emit_rel32(j, j->code + j->exit);
+}
+
+/* leave for `target`, jumping straight there once it is translated */
+void emit_chain(struct jit* j, uint16_t target)
+{
+    emit8(j, 0xE9);
+    uint8_t* at = j->p;
+    if (j->block[target])
+    {
+        emit_rel32(j, j->block[target]);
+    }
+    else
+    {
+        emit32(j, 0);
+        if (j->link_count == j->link_max)
+        {
+            j->link_max = j->link_max ? j->link_max * 2 : 1024;
+            j->links = realloc(j->links, j->link_max * sizeof(*j->links));
+        }
+        j->links[j->link_count].at = (uint32_t)(at - j->code);
+        j->links[j->link_count].target = target;
+        ++j->link_count;
+    }
+    emit_exit_pc(j, target);
+}
+
+/* leave for the address in eax */
+void emit_dispatch(struct jit* j)
+{
+    emit_store_reg(j, R_PC);
+    emit8(j, 0x48); emit8(j, 0xB9); emit64(j, (uint64_t)(uintptr_t)j->block); /* mov rcx, block */
+    emit8(j, 0x48); emit8(j, 0x8B); emit8(j, 0x04); emit8(j, 0xC1);  /* mov rax, [rcx + rax*8] */
+    emit8(j, 0x48); emit8(j, 0x85); emit8(j, 0xC0);                  /* test rax, rax */
+    emit8(j, 0x0F); emit8(j, 0x84); emit_rel32(j, j->code + j->exit); /* jz exit */
+    emit8(j, 0xFF); emit8(j, 0xE0);                                  /* jmp rax */
+}
+
+/* after a store: leave at `next` if it hit translated code or a device wants the slice to end */
+void emit_stale_check(struct jit* j, uint16_t next, uint32_t executed)
+{
+    emit8(j, 0x80); emit8(j, 0xBB);                 /* cmp byte [rbx + stale], 0 */
+    emit32(j, offsetof(struct vm, jit_stale)); emit8(j, 0x00);
+    emit8(j, 0x75); emit8(j, 9);                    /* jne leave */
+    emit8(j, 0x83); emit8(j, 0xBB);                 /* cmp dword [rbx + yield], 0 */
+    emit32(j, offsetof(struct vm, yield)); emit8(j, 0x00);
+    emit8(j, 0x74); uint8_t* skip = j->p; emit8(j, 0); /* je over */
+    emit_sync_flags(j);
+    emit8(j, 0x49); emit8(j, 0x81); emit8(j, 0x45); emit8(j, 0x00); /* add qword [r13], len - executed */
+    j->refunds[j->refund_count].at = j->p;
+    j->refunds[j->refund_count].executed = executed;
+    ++j->refund_count;
+    emit32(j, 0);
+    emit_exit_pc(j, next);
+    *skip = (uint8_t)(j->p - (skip + 1));
+}
+
+void jit_flush(struct vm* vm)
+{
+    struct jit* j = vm->jit;
+    j->used = j->base;
+    j->link_count = 0;
+    vm->jit_stale = 0;
+    memset(j->block, 0, sizeof(j->block));
+    store_hooks_clear(vm, HOOK_JIT);
+}
+
+/* forget everything, including how hot each block was */
+void jit_reset(struct vm* vm)
+{
+    jit_flush(vm);
+    memset(vm->jit->heat, 0, sizeof(vm->jit->heat));
+}
+
+/* turn the JIT on for `vm` */
+int jit_init(struct vm* vm)
+{
+    struct jit* j = calloc(1, sizeof(*j));
+    if (!j || !store_hooks_init(vm))
+    {
+        free(j);
+        return 0;
+    }
+    j->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->code == MAP_FAILED)
+    {
+        free(j);
+        return 0;
+    }
+    j->fuel = INT64_MAX;
+
+    /* entry: save the callee-saved registers we use and jump to the block */
+    j->p = j->code;
+    emit8(j, 0x53);                                 /* push rbx */
+    emit8(j, 0x41); emit8(j, 0x54);                 /* push r12 */
+    emit8(j, 0x41); emit8(j, 0x55);                 /* push r13 */
+    emit8(j, 0x48); emit8(j, 0x89); emit8(j, 0xFB); /* mov rbx, rdi */
+    emit8(j, 0x49); emit8(j, 0x89); emit8(j, 0xF4); /* mov r12, rsi */
+    emit8(j, 0x49); emit8(j, 0x89); emit8(j, 0xD5); /* mov r13, rdx */
+    emit8(j, 0xFF); emit8(j, 0xE1);                 /* jmp rcx */
+
+    j->exit = j->p - j->code;
+    emit8(j, 0x41); emit8(j, 0x5D);                 /* pop r13 */
+    emit8(j, 0x41); emit8(j, 0x5C);                 /* pop r12 */
+    emit8(j, 0x5B);                                 /* pop rbx */
+    emit8(j, 0xC3);                                 /* ret */
+
+    j->entry = (void*)j->code;
+    j->base = j->p - j->code;
+    vm->jit = j;
+    jit_flush(vm);
+    return 1;
+}
+
+void jit_destroy(struct vm* vm)
+{
+    struct jit* j = vm->jit;
+    if (!j)
+    {
+        return;
+    }
+    munmap(j->code, JIT_CODE_SIZE);
+    free(j->links);
+    free(j);
+    vm->jit = NULL;
+    store_hooks_clear(vm, HOOK_JIT);
+}
+
+void* jit_translate(struct vm* vm, uint16_t start)
+{
+    struct jit* j = vm->jit;
+    if (JIT_CODE_SIZE - j->used < JIT_BLOCK_BYTES)
+    {
+        jit_flush(vm);
+    }
+
+    uint8_t* entry = j->code + j->used;
+    j->p = entry;
+    j->flag_reg = -1;
+    j->refund_count = 0;
+
+    /* charge the whole block up front, give it back if we are out of fuel */
+    emit8(j, 0x49); emit8(j, 0x81); emit8(j, 0x6D); emit8(j, 0x00); /* sub qword [r13], len */
+    uint8_t* charge = j->p; emit32(j, 0);
+    emit8(j, 0x79); emit8(j, 19);                                   /* jns body */
+    emit8(j, 0x49); emit8(j, 0x81); emit8(j, 0x45); emit8(j, 0x00); /* add qword [r13], len */
+    uint8_t* refund = j->p; emit32(j, 0);
+    emit_exit_pc(j, start);
+
+    uint16_t pc = start;
+    uint32_t len = 0;
+    int open = 1;
+    while (open)
+    {
+        if (len == JIT_BLOCK_LEN || pc >= MR_IO)
+        {
+            emit_sync_flags(j);
+            emit_chain(j, pc);
+            break;
+        }
+
+        struct decoded* d = fetch(vm, pc);
+        uint8_t op = d->base; /* superinstructions are translated one instruction at a time */
+        uint16_t next = pc + 1;
+        uint16_t address = next + d->imm;
+
+        /* leave anything the interpreter has to see to the interpreter */
+        int device = address >= MR_IO;
+        if (op == OP_TRAP || op == OP_RTI || op == OP_RES
+            || op == OP_LD_IO || op == OP_ST_IO
+            || (device && (op == OP_LDI || op == OP_STI)))
+        {
+            if (len == 0)
+            {
+                return NULL;
+            }
+            emit_sync_flags(j);
+            emit_chain(j, pc);
+            break;
+        }
+
+        ++len;
+        vm->store_hooks[pc] |= HOOK_JIT;
+
+        switch (op)
+        {
+            case OP_ADD:
+            case OP_AND:
+                emit_load_reg(j, 0, d->r1);
+                if (d->flags & DEC_IMM)
+                {
+                    emit8(j, op == OP_ADD ? 0x05 : 0x25); emit32(j, d->imm); /* add/and eax, imm */
+                }
+                else
+                {
+                    emit_load_reg(j, 1, d->r2);
+                    emit8(j, op == OP_ADD ? 0x01 : 0x21); emit8(j, 0xC8);    /* add/and eax, ecx */
+                }
+                emit_store_reg(j, d->r0);
+                j->flag_reg = d->r0;
+                break;
+            case OP_NOT:
+                emit_load_reg(j, 0, d->r1);
+                emit8(j, 0xF7); emit8(j, 0xD0);                                /* not eax */
+                emit_store_reg(j, d->r0);
+                j->flag_reg = d->r0;
+                break;
+            case OP_LEA:
+                emit_store_reg_imm(j, d->r0, address);
+                j->flag_reg = d->r0;
+                break;
+            case OP_LD:
+                emit_read_abs(j, address);
+                emit_store_reg(j, d->r0);
+                j->flag_reg = d->r0;
+                break;
+            case OP_LDI:
+                emit_read_abs(j, address);
+                emit_read(j);
+                emit_store_reg(j, d->r0);
+                j->flag_reg = d->r0;
+                break;
+            case OP_LDR:
+                emit_load_reg(j, 0, d->r1);
+                emit8(j, 0x05); emit32(j, d->imm);                             /* add eax, imm */
+                emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0xC0);                /* movzx eax, ax */
+                emit_read(j);
+                emit_store_reg(j, d->r0);
+                j->flag_reg = d->r0;
+                break;
+            case OP_ST:
+            case OP_STI:
+            case OP_STR:
+                if (op == OP_ST)
+                {
+                    emit8(j, 0xB8); emit32(j, address);                        /* mov eax, address */
+                }
+                else if (op == OP_STI)
+                {
+                    emit_read_abs(j, address);
+                }
+                else
+                {
+                    emit_load_reg(j, 0, d->r1);
+                    emit8(j, 0x05); emit32(j, d->imm);                         /* add eax, imm */
+                    emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0xC0);            /* movzx eax, ax */
+                }
+                emit8(j, 0x89); emit8(j, 0xC6);                                /* mov esi, eax */
+                emit_load_reg(j, 2, d->r0);                                    /* movzx edx, [sr] */
+                emit_call(j, mem_write);
+                emit_stale_check(j, next, len);
+                break;
+            case OP_BR:
+                if (d->r0 == 0)
+                {
+                    break; /* never taken */
+                }
+                emit_sync_flags(j);
+                if (d->r0 != (FL_NEG | FL_ZRO | FL_POS))
+                {
+                    if (j->flag_reg < 0)
+                    {
+                        emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0x43); emit8(j, JIT_COND); /* movzx eax, [rbx + cond] */
+                    }
+                    emit8(j, 0x66); emit8(j, 0x85); emit8(j, 0xC0);            /* test ax, ax */
+                    emit8(j, 0x0F); emit8(j, 0x80 | (jit_branch_cc[d->r0] ^ 1)); /* j!cc fall through */
+                    uint8_t* skip = j->p; emit32(j, 0);
+                    emit_chain(j, address);
+                    patch_rel32(skip, j->p);
+                    emit_chain(j, next);
+                }
+                else
+                {
+                    emit_chain(j, address);
+                }
+                open = 0;
+                break;
+            case OP_JMP:
+                emit_sync_flags(j);
+                emit_load_reg(j, 0, d->r1);
+                emit_dispatch(j);
+                open = 0;
+                break;
+            case OP_JSR:
+                emit_sync_flags(j);
+                if (d->flags & DEC_IMM)
+                {
+                    emit_store_reg_imm(j, R_R7, next);
+                    emit_chain(j, address);
+                }
+                else
+                {
+                    emit_load_reg(j, 0, d->r1);
+                    emit_store_reg_imm(j, R_R7, next);
+                    emit_dispatch(j);
+                }
+                open = 0;
+                break;
+        }
+        pc = next;
+    }
+
+    memcpy(charge, &len, 4);
+    memcpy(refund, &len, 4);
+    for (int i = 0; i < j->refund_count; ++i)
+    {
+        uint32_t skipped = len - j->refunds[i].executed;
+        memcpy(j->refunds[i].at, &skipped, 4);
+    }
+
+    j->used = j->p - j->code;
+    j->block[start] = entry;
+
+    for (size_t i = 0; i < j->link_count; )
+    {
+        if (j->links[i].target == start)
+        {
+            patch_rel32(j->code + j->links[i].at, entry);
+            j->links[i] = j->links[--j->link_count];
+        }
+        else
+        {
+            ++i;
+        }
+    }
+    return entry;
+}
+
+/*
+ * Called from a device read: native code leaves at the start of its next
+ * block, as if out of fuel, and jit_dispatch() gives the fuel back, so the
+ * interpreter sees what the read asked for at most a block later.
+ */
+void jit_leave(struct vm* vm)
+{
+    struct jit* j = vm->jit;
+    if (j->native)
+    {
+        j->held += j->fuel;
+        j->fuel = 0;
+    }
+}
+
+/* called by the interpreter whenever control reaches the start of a block */
+void jit_dispatch(struct vm* vm)
+{
+    struct jit* j = vm->jit;
+    for (;;)
+    {
+        if (vm->jit_stale)
+        {
+            jit_flush(vm);
+        }
+
+        uint16_t pc = vm->reg[R_PC];
+        void* code = j->block[pc];
+        if (!code)
+        {
+            if (++j->heat[pc] < JIT_HOT)
+            {
+                return;
+            }
+            j->heat[pc] = 0;
+            code = jit_translate(vm, pc);
+            if (!code)
+            {
+                return;
+            }
+        }
+
+        int64_t fuel = j->fuel;
+        j->native = 1;
+        j->entry(vm, vm->memory, &j->fuel, code);
+        j->native = 0;
+        if (j->held)
+        {
+            j->fuel += j->held;
+            j->held = 0;
+            return;
+        }
+        if (j->fuel == fuel || vm->yield)
+        {
+            return; /* out of fuel, nothing native to run, or the slice is over */
+        }
+    }
+}
@@ -1,12 +1,24 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
 #include <signal.h>
 #include "utils.c"
 
 enum
 {
+    MR_IO = 0xFE00,   /* start of the device page, everything below is RAM */
     MR_KBSR = 0xFE00, /* keyboard status */
-    MR_KBDR = 0xFE02  /* keyboard data */
+    MR_KBDR = 0xFE02, /* keyboard data */
+    MR_DSR = 0xFE04,  /* display status */
+    MR_DDR = 0xFE06,  /* display data */
+    MR_TSR = 0xFE08,  /* timer status */
+    MR_TIR = 0xFE0A,  /* timer interval, in instructions */
+    MR_DBR = 0xFE10,  /* display base, where the character grid starts */
+    MR_DCR = 0xFE12,  /* display control, bit 15 shows the grid */
+    MR_PSR = 0xFFFC,  /* processor status */
+    MR_MCR = 0xFFFE   /* machine control, clearing bit 15 stops the machine */
 };
 
 enum
@@ -20,7 +32,44 @@ enum
 };
 
 #define MEMORY_MAX (1 << 16)
-uint16_t memory[MEMORY_MAX];
+#define PAGE_WORDS 256 /* the unit vm->dirty and vm->populated keep track of */
+#define PAGE_COUNT (MEMORY_MAX / PAGE_WORDS)
+#define PAGE_MAP_WORDS (PAGE_COUNT / 64)
+
+/* instructions unpacked once on first fetch, see decode() */
+struct decoded
+{
+    uint8_t op;
+    uint8_t r0;    /* DR or SR, the nzp mask for BR */
+    uint8_t r1;    /* SR1 or BaseR */
+    uint8_t r2;    /* SR2 */
+    uint16_t imm;  /* sign extended imm5/offset6/PCoffset9/PCoffset11, or trapvect8 */
+    uint16_t imm2; /* the second instruction's, for a superinstruction */
+    uint8_t flags; /* DEC_* */
+    uint8_t base;  /* op of the first instruction alone, see fuse() */
+};
+
+enum
+{
+    DEC_VALID = 1 << 0,
+    DEC_IMM = 1 << 1  /* immediate form of ADD/AND, JSR rather than JSRR */
+};
+
+/* the JIT tier (jit.c) emits x86-64 and needs mmap */
+#if defined(__x86_64__) && defined(linux) && !defined(LC3_NO_JIT)
+#define LC3_JIT 1
+#else
+#define LC3_JIT 0
+#endif
+
+/* what mem_write() has to do besides storing, per word in vm->store_hooks */
+enum
+{
+    HOOK_JIT = 1 << 0,   /* part of translated code */
+    HOOK_WATCH = 1 << 1  /* call vm->on_watch */
+};
+
+uint8_t hooks_none[MEMORY_MAX]; /* store_hooks of a VM nothing listens to, all zero */
 
 enum
 {
@@ -36,7 +85,6 @@ enum
     R_COND,
     R_COUNT
 };
-uint16_t reg[R_COUNT];
 
 enum
 {
@@ -65,6 +113,99 @@ enum
     OP_TRAP    /* execute trap */
 };
 
+/* opcodes that only exist in the decoded form */
+enum
+{
+    OP_LD_IO = OP_TRAP + 1, /* LD from the device page */
+    OP_ST_IO,               /* ST to the device page */
+    OP_COUNT
+};
+
+/*
+ * Superinstructions, two instructions run by one handler. The entry keeps
+ * the first instruction's fields, so it can still run alone as `base`;
+ * the second one's go in r2 and imm2.
+ */
+enum
+{
+    OP_CONST = OP_COUNT, /* AND Rx,Rx,#0; ADD Rx,Rx,#imm2 */
+    OP_PUSH,             /* ADD Ra,Ra,#imm; STR R(r2),Ra,#imm2 */
+    OP_POP,              /* LDR Rd,Ra,#imm; ADD Ra,Ra,#imm2 */
+    OP_ADD_BR,           /* ADD Rd,Rs,#imm; BR(r2) imm2 */
+    OP_FUSED_COUNT
+};
+
+struct vm;
+typedef void (*trap_fn)(struct vm* vm, uint16_t vector);
+
+/* timed device work, see interrupts.c */
+#define EVENTS_MAX 16
+
+enum
+{
+    EVENT_TIMER,
+    EVENT_KEY       /* the next keys of an input script */
+};
+
+struct event
+{
+    uint64_t when;  /* vm->instructions it is due at */
+    int kind;       /* EVENT_* */
+};
+
+/*
+ * Everything one machine owns. A process can run any number of these, each
+ * on one thread at a time. The JIT addresses reg[] and cond_value from the
+ * start of the struct, so they stay first.
+ */
+struct vm
+{
+    uint16_t reg[R_COUNT];
+    uint16_t cond_value;       /* see update_flags() */
+    int running;
+    uint64_t budget;           /* instructions left for the budgeted interpreters */
+    uint16_t* memory;          /* MEMORY_MAX words */
+    struct decoded* decoded;   /* MEMORY_MAX entries, see decode() */
+    uint8_t* view;             /* snapshot both point into, see vm_restore() */
+    size_t view_size;
+    struct kbd_fifo* kbd;      /* where keys come from */
+    unsigned kbd_empty_polls;  /* see kbsr_read() */
+    struct console* console;   /* where output goes */
+    struct profile* profile;   /* filled in by run_profile() */
+    struct trace* trace;       /* filled in by run_trace() */
+    struct display* display;   /* the character grid, see display.c */
+    struct debug* debug;       /* breakpoints and watchpoints for run_debug() */
+    int fuse;                  /* let decode() build superinstructions */
+    trap_fn traps[256];        /* see set_traps() */
+    uint16_t psr;              /* privilege and priority, the flags are in cond_value */
+    uint16_t saved_ssp;        /* R6 of whichever mode is not running */
+    uint16_t saved_usp;
+    int irq_enabled;           /* some device has interrupts on, see interrupt_check() */
+    int idle;                  /* the guest is waiting for an interrupt */
+    int yield;                 /* end the slice after this instruction, see run_limited() */
+    int timer_dirty;           /* TIR was written */
+    uint64_t instructions;     /* run so far under run_limited() */
+    struct event events[EVENTS_MAX];   /* a min-heap on `when` */
+    unsigned event_count;
+    uint64_t dirty[PAGE_MAP_WORDS];     /* a bit per page written since pages_clean() */
+    uint64_t populated[PAGE_MAP_WORDS]; /* pages written before that, see page_populated() */
+    uint8_t* store_hooks;      /* HOOK_* per word, hooks_none unless some are set */
+    void (*on_watch)(struct vm* vm, uint16_t address, uint16_t val);
+    const struct script* script;   /* keys to replay, see script_start() */
+    unsigned script_next;      /* the first key not handed over yet */
+    struct record* record;     /* the session being recorded, see record.c */
+    void* embedder;            /* the handle of a VM run through lc3.h, see lib.c */
+    int stopped;               /* STOP_* an embedded VM's run ends with after this slice, 0 for none */
+    uint16_t trap_vector;      /* of the TRAP it stopped at */
+#if LC3_JIT
+    volatile uint8_t jit_stale;/* translated code was written over */
+    struct jit* jit;           /* NULL unless the JIT is on */
+#endif
+};
+
+#define R_BITMASK 0x7
+#define BOOL_BITMASK 0x1
+
 uint16_t sign_extend(uint16_t x, int bit_count)
 {
     if ((x >> (bit_count - 1)) & 1) {
@@ -73,19 +214,84 @@ uint16_t sign_extend(uint16_t x, int bit_count)
     return x;
 }
 
-void update_flags(uint16_t r)
+/*
+ * The condition codes are evaluated lazily: instructions only remember the
+ * value they wrote in vm->cond_value and N/Z/P are derived from it when a
+ * BR tests them or the state is inspected. reg[R_COND] is only valid after
+ * sync_cond().
+ */
+static inline void update_flags(struct vm* vm, uint16_t r)
+{
+    vm->cond_value = vm->reg[r];
+}
+
+/* the FL_* of a condition value, the interpreters keep theirs in a local */
+static inline uint16_t flags_of(uint16_t value)
+{
+    uint16_t n = value >> 15; /* a 1 in the left-most bit indicates negative */
+    uint16_t z = value == 0;
+    return n << 2 | z << 1 | ((n | z) ^ 1);
+}
+
+static inline uint16_t cond_flags(struct vm* vm)
+{
+    return flags_of(vm->cond_value);
+}
+
+void sync_cond(struct vm* vm)
+{
+    vm->reg[R_COND] = cond_flags(vm);
+}
+
+/* pick a value that gives back the flags in reg[R_COND] */
+void load_cond(struct vm* vm)
 {
-    if (reg[r] == 0)
+    uint16_t cond = vm->reg[R_COND];
+    vm->cond_value = cond & FL_NEG ? 0x8000 : cond & FL_ZRO ? 0 : 1;
+}
+
+/*
+ * Every store sets the bit of its page in vm->dirty, which is all it costs.
+ * pages_clean() moves the dirty bits into vm->populated, so together they
+ * say which pages have ever been written: snapshots, checkpoints and the CFG
+ * skip the rest, which for most programs is all but a few of them. The
+ * device page always counts as written, its registers live in memory[] too.
+ */
+static inline void page_dirty(struct vm* vm, uint16_t address)
+{
+    unsigned p = address / PAGE_WORDS;
+    vm->dirty[p / 64] |= (uint64_t)1 << (p % 64);
+}
+
+static inline int page_populated(const struct vm* vm, unsigned p)
+{
+    return ((vm->populated[p / 64] | vm->dirty[p / 64]) >> (p % 64)) & 1;
+}
+
+void pages_clean(struct vm* vm)
+{
+    for (int i = 0; i < PAGE_MAP_WORDS; ++i)
     {
-        reg[R_COND] = FL_ZRO;
+        vm->populated[i] |= vm->dirty[i];
+        vm->dirty[i] = 0;
     }
-    else if (reg[r] >> 15) /* a 1 in the left-most bit indicates negative */
+}
+
+void pages_clear(struct vm* vm)
+{
+    memset(vm->dirty, 0, sizeof(vm->dirty));
+    memset(vm->populated, 0, sizeof(vm->populated));
+    for (unsigned p = MR_IO / PAGE_WORDS; p < PAGE_COUNT; ++p)
     {
-        reg[R_COND] = FL_NEG;
+        vm->populated[p / 64] |= (uint64_t)1 << (p % 64);
     }
-    else
+}
+
+void pages_mark(struct vm* vm, uint16_t origin, size_t count)
+{
+    for (size_t a = origin & ~(PAGE_WORDS - 1); a < origin + count; a += PAGE_WORDS)
     {
-        reg[R_COND] = FL_POS;
+        page_dirty(vm, (uint16_t)a);
     }
 }
 
@@ -94,329 +300,1705 @@ uint16_t swap16(uint16_t x)
     return (x << 8) | (x >> 8);
 }
 
-void read_image_file(FILE* file)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* dst[i] = swap16(src[i]), `src` needs no particular alignment */
+void swap16_copy(uint16_t* dst, const uint8_t* src, size_t n)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i order = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                           1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i * 2));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(v, order));
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 2));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 8 <= n; i += 8)
+    {
+        vst1q_u16(dst + i, vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(src + i * 2))));
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        dst[i] = (uint16_t)(src[i * 2] << 8 | src[i * 2 + 1]);
+    }
+}
+
+/*
+ * Images are the assembler's big-endian .obj files: the origin followed by
+ * the words to place there. A cached image starts with IMAGE_CACHED_MAGIC
+ * and holds the same origin and words already in host order behind an
+ * 8 byte header, so loading it is one copy (see --convert). A path ending
+ * in .asm is LC-3 source, assembled in place by asm.c.
+ */
+#define IMAGE_CACHED_MAGIC "LC3L"
+#define IMAGE_CACHED_HEADER 8 /* magic, origin, two bytes of padding */
+
+enum
+{
+    IMAGE_OK = 0,
+    IMAGE_UNREADABLE,
+    IMAGE_TRUNCATED,   /* no origin, or half a word at the end */
+    IMAGE_TOO_LONG,    /* runs past the end of memory */
+    IMAGE_ASM          /* source that does not assemble, see asm.c */
+};
+
+const char* image_errors[] = { "ok", "cannot be read", "is truncated", "runs past the end of memory",
+                               "does not assemble" };
+
+#include "asm.c"
+
+/* where an image of either format goes, without loading it */
+struct image_header
 {
-    /* the origin tells us where in memory to place the image */
     uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);
-    origin = swap16(origin);
+    size_t count;      /* words */
+    int cached;
+};
+
+int image_scan(const uint8_t* data, size_t size, struct image_header* h)
+{
+    h->cached = size >= IMAGE_CACHED_HEADER && memcmp(data, IMAGE_CACHED_MAGIC, 4) == 0;
+    size_t header = h->cached ? IMAGE_CACHED_HEADER : 2;
+    if (size < header || (size - header) % 2)
+    {
+        return IMAGE_TRUNCATED;
+    }
+
+    /* the origin tells us where in memory to place the image */
+    if (h->cached)
+    {
+        memcpy(&h->origin, data + 4, 2);
+    }
+    else
+    {
+        h->origin = (uint16_t)(data[0] << 8 | data[1]);
+    }
+
+    h->count = (size - header) / 2;
+    if (h->count > (size_t)(MEMORY_MAX - h->origin))
+    {
+        return IMAGE_TOO_LONG;
+    }
+    return IMAGE_OK;
+}
+
+/* copy the words of a scanned image into place, touching nothing around them */
+void image_place(struct vm* vm, const uint8_t* data, const struct image_header* h)
+{
+    if (h->cached)
+    {
+        memcpy(vm->memory + h->origin, data + IMAGE_CACHED_HEADER, h->count * 2);
+    }
+    else
+    {
+        swap16_copy(vm->memory + h->origin, data + 2, h->count);
+    }
+    memset(vm->decoded + h->origin, 0, h->count * sizeof(*vm->decoded));
+}
+
+/* load an image of either format from `size` bytes at `data` */
+int load_image(struct vm* vm, const uint8_t* data, size_t size)
+{
+    struct image_header h;
+    int result = image_scan(data, size, &h);
+    if (result != IMAGE_OK)
+    {
+        return result;
+    }
+    image_place(vm, data, &h);
+    pages_mark(vm, h.origin, h.count);
+    vm->decoded[(uint16_t)(h.origin - 1)].flags = 0; /* may have fused with the first word */
+    return IMAGE_OK;
+}
+
+int read_image(struct vm* vm, const char* image_path)
+{
+    size_t size;
+    const uint8_t* data = map_file(image_path, &size);
+    if (!data) { return IMAGE_UNREADABLE; };
+    int result = is_asm(image_path) ? asm_image(vm, image_path, (const char*)data, size)
+                                    : load_image(vm, data, size);
+    unmap_file(data, size);
+    return result;
+}
+
+/* write `image_path` to `out_path` as a cached image */
+int convert_image(const char* image_path, const char* out_path)
+{
+    size_t size;
+    const uint8_t* data = map_file(image_path, &size);
+    if (!data) { return IMAGE_UNREADABLE; };
+
+    /* the origin and the words, swapped together */
+    size_t count = size / 2;
+    uint16_t* words = size >= 2 && size % 2 == 0 ? malloc(count * sizeof(uint16_t)) : NULL;
+    int result = IMAGE_TRUNCATED;
+    if (words)
+    {
+        swap16_copy(words, data, count);
+        result = count - 1 > (size_t)(MEMORY_MAX - words[0]) ? IMAGE_TOO_LONG : IMAGE_OK;
+    }
+    unmap_file(data, size);
+
+    if (result == IMAGE_OK)
+    {
+        uint8_t header[IMAGE_CACHED_HEADER] = { 'L', 'C', '3', 'L' };
+        memcpy(header + 4, &words[0], 2);
+        FILE* out = fopen(out_path, "wb");
+        if (!out
+            || fwrite(header, sizeof(header), 1, out) != 1
+            || fwrite(words + 1, sizeof(uint16_t), count - 1, out) != count - 1)
+        {
+            result = IMAGE_UNREADABLE;
+        }
+        if (out && fclose(out) != 0)
+        {
+            result = IMAGE_UNREADABLE;
+        }
+    }
+    free(words);
+    return result;
+}
+
+/*
+ * The device page is served by a table of memory-mapped I/O handlers, an
+ * address without one behaves like RAM. Everything below MR_IO is plain
+ * memory and never looks at the table.
+ */
+typedef uint16_t (*io_read_fn)(struct vm* vm, uint16_t address);
+typedef void (*io_write_fn)(struct vm* vm, uint16_t address, uint16_t val);
+
+struct device
+{
+    io_read_fn read;
+    io_write_fn write;
+};
+struct device devices[MEMORY_MAX - MR_IO];
+
+void io_register(uint16_t address, io_read_fn read, io_write_fn write)
+{
+    devices[address - MR_IO].read = read;
+    devices[address - MR_IO].write = write;
+}
+
+uint16_t io_read(struct vm* vm, uint16_t address)
+{
+    struct device* dev = &devices[address - MR_IO];
+    return dev->read ? dev->read(vm, address) : vm->memory[address];
+}
+
+/* a store hit a word with HOOK_* set, kept out of line so mem_write() stays small */
+void store_hook(struct vm* vm, uint16_t address, uint16_t val)
+{
+    uint8_t hooks = vm->store_hooks[address];
+#if LC3_JIT
+    if (hooks & HOOK_JIT)
+    {
+        vm->jit_stale = 1;
+    }
+#endif
+    if (hooks & HOOK_WATCH)
+    {
+        vm->on_watch(vm, address, val);
+    }
+}
 
-    /* we know the maximum file size so we only need one fread */
-    uint16_t max_read = MEMORY_MAX - origin;
-    uint16_t* p = memory + origin;
-    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+/* give `vm` store hooks of its own, returns 0 if out of memory */
+int store_hooks_init(struct vm* vm)
+{
+    if (vm->store_hooks == hooks_none)
+    {
+        uint8_t* hooks = calloc(MEMORY_MAX, 1);
+        if (!hooks) return 0;
+        vm->store_hooks = hooks;
+    }
+    return 1;
+}
 
-    /* swap to little endian */
-    while (read-- > 0)
+/* clear `hook` on every word */
+void store_hooks_clear(struct vm* vm, uint8_t hook)
+{
+    if (vm->store_hooks == hooks_none) return;
+    for (size_t i = 0; i < MEMORY_MAX; ++i)
     {
-        *p = swap16(*p);
-        ++p;
+        vm->store_hooks[i] &= (uint8_t)~hook;
     }
 }
 
-int read_image(const char* image_path)
+/* call `fn` after every store to `address` while `on`, see store_hook() */
+int watch_word(struct vm* vm, uint16_t address, int on,
+               void (*fn)(struct vm* vm, uint16_t address, uint16_t val))
 {
-    FILE* file = fopen(image_path, "rb");
-    if (!file) { return 0; };
-    read_image_file(file);
-    fclose(file);
+    if (!store_hooks_init(vm)) return 0;
+    vm->on_watch = fn;
+    if (on) vm->store_hooks[address] |= HOOK_WATCH;
+    else vm->store_hooks[address] &= (uint8_t)~HOOK_WATCH;
     return 1;
 }
 
-void mem_write(uint16_t address, uint16_t val)
+void io_write(struct vm* vm, uint16_t address, uint16_t val)
+{
+    struct device* dev = &devices[address - MR_IO];
+    if (dev->write)
+    {
+        dev->write(vm, address, val);
+    }
+    else
+    {
+        vm->memory[address] = val;
+    }
+}
+
+static inline void mem_write(struct vm* vm, uint16_t address, uint16_t val)
 {
-    memory[address] = val;
+    if (address >= MR_IO)
+    {
+        io_write(vm, address, val);
+        return;
+    }
+
+    vm->memory[address] = val;
+    page_dirty(vm, address);
+    /* the program wrote over code, or the second half of a superinstruction */
+    vm->decoded[address].flags = 0;
+    vm->decoded[(uint16_t)(address - 1)].flags = 0;
+    if (vm->store_hooks[address])
+    {
+        store_hook(vm, address, val);
+    }
+}
+
+static inline uint16_t mem_read(struct vm* vm, uint16_t address)
+{
+    return address < MR_IO ? vm->memory[address] : io_read(vm, address);
 }
 
-uint16_t mem_read(uint16_t address)
+#include "display.c"
+
+/*
+ * A guest that keeps polling an empty keyboard is idle, so after
+ * KBD_SPIN_POLLS empty reads in a row each further one sleeps until a key
+ * arrives or KBD_SPIN_WAIT_MS pass.
+ */
+#define KBD_SPIN_POLLS 1000
+#define KBD_SPIN_WAIT_MS 1
+
+#if LC3_JIT
+void jit_leave(struct vm* vm); /* in jit.c */
+#endif
+
+uint16_t kbsr_read(struct vm* vm, uint16_t address)
 {
-    if (address == MR_KBSR)
+    uint16_t* memory = vm->memory;
+    console_flush_for_input(vm->console);
+    if (!(memory[MR_KBSR] & (1 << 15)))
     {
-        if (check_key())
+        uint16_t c;
+        /* scripted and recorded keys come on the clock, waiting for them would only stall it */
+        if (vm->kbd_empty_polls >= KBD_SPIN_POLLS && !vm->script && !vm->record && !vm->embedder)
+        {
+            display_idle(vm);
+            input_wait(vm->kbd, KBD_SPIN_WAIT_MS);
+        }
+
+        if (kbd_pop(vm->kbd, &c))
         {
-            memory[MR_KBSR] = (1 << 15);
-            memory[MR_KBDR] = getchar();
+            memory[MR_KBSR] |= 1 << 15;
+            memory[MR_KBDR] = c;
+            vm->kbd_empty_polls = 0;
         }
         else
         {
-            memory[MR_KBSR] = 0;
+            /*
+             * an embedded VM gives its thread back instead, at the end of
+             * the block, and a slice of sleeps would hold up a ^C as long
+             */
+            if (++vm->kbd_empty_polls >= KBD_SPIN_POLLS
+                && ((vm->embedder && kbd_empty(vm->kbd)) || interrupt_pending))
+            {
+                vm->idle = 1;
+                vm->irq_enabled = 1;
+#if LC3_JIT
+                /* a polling loop in native code would otherwise keep going */
+                if (vm->jit) jit_leave(vm);
+#endif
+            }
         }
     }
-    return memory[address];
+    return memory[MR_KBSR];
 }
 
-#define R_BITMASK 0x7
-#define BOOL_BITMASK 0x1
+/* reading the data register takes the key */
+uint16_t kbdr_read(struct vm* vm, uint16_t address)
+{
+    vm->memory[MR_KBSR] &= ~(1 << 15);
+    return vm->memory[MR_KBDR];
+}
 
-int main(int argc, const char* argv[])
+#include "interrupts.c"
+#include "script.c"
+#include "record.c"
+
+/* the display takes a character at a time and is always ready */
+uint16_t dsr_read(struct vm* vm, uint16_t address)
+{
+    return 1 << 15;
+}
+
+void ddr_write(struct vm* vm, uint16_t address, uint16_t val)
+{
+    console_putc(vm->console, (char)val);
+}
+
+/* what the OS's HALT routine does to stop the clock */
+void mcr_write(struct vm* vm, uint16_t address, uint16_t val)
 {
-    if (argc < 2)
+    vm->memory[MR_MCR] = val;
+    if (!(val & (1 << 15)))
     {
-        /* show usage string */
-        printf("lc3 [image-file1] ...\n");
-        exit(2);
+        console_flush(vm->console);
+        vm->running = 0;
+        vm->yield = 1;
+    }
+}
+
+void devices_init()
+{
+    io_register(MR_KBSR, kbsr_read, kbsr_write);
+    io_register(MR_KBDR, kbdr_read, NULL);
+    io_register(MR_DSR, dsr_read, NULL);
+    io_register(MR_DDR, NULL, ddr_write);
+    io_register(MR_TSR, tsr_read, tsr_write);
+    io_register(MR_TIR, NULL, tir_write);
+    io_register(MR_PSR, psr_read, psr_write);
+    io_register(MR_MCR, NULL, mcr_write);
+}
+
+/*
+ * Turn `d` into a superinstruction if it and `next`, the word after it, are
+ * one of the common pairs. None of the first instructions write memory, so
+ * `next` is still what runs second; a write to either word drops the entry,
+ * see mem_write().
+ */
+void fuse(struct decoded* d, uint16_t next)
+{
+    unsigned op = next >> 12;
+    unsigned r0 = (next >> 9) & R_BITMASK;
+    unsigned r1 = (next >> 6) & R_BITMASK;
+    int add_imm = op == OP_ADD && ((next >> 5) & BOOL_BITMASK);
+
+    if (d->op == OP_AND && (d->flags & DEC_IMM) && d->imm == 0 && d->r1 == d->r0
+        && add_imm && r0 == d->r0 && r1 == d->r0)
+    {
+        d->op = OP_CONST;
+        d->imm2 = sign_extend(next & 0x1F, 5);
+    }
+    else if (d->op == OP_ADD && (d->flags & DEC_IMM) && op == OP_STR && r1 == d->r0)
+    {
+        d->op = OP_PUSH;
+        d->r2 = r0;
+        d->imm2 = sign_extend(next & 0x3F, 6);
+    }
+    else if (d->op == OP_LDR && add_imm && r0 == d->r1 && r1 == d->r1)
+    {
+        d->op = OP_POP;
+        d->imm2 = sign_extend(next & 0x1F, 5);
+    }
+    else if (d->op == OP_ADD && (d->flags & DEC_IMM) && op == OP_BR)
+    {
+        d->op = OP_ADD_BR;
+        d->r2 = r0;
+        d->imm2 = sign_extend(next & 0x1FF, 9);
+    }
+}
+
+void decode(struct vm* vm, uint16_t address)
+{
+    uint16_t instr = mem_read(vm, address);
+    struct decoded* d = &vm->decoded[address];
+
+    d->op = instr >> 12;
+    d->r0 = (instr >> 9) & R_BITMASK;
+    d->r1 = (instr >> 6) & R_BITMASK;
+    d->r2 = instr & R_BITMASK;
+    d->imm = 0;
+    d->imm2 = 0;
+    d->flags = 0;
+
+    switch (d->op)
+    {
+        case OP_ADD:
+        case OP_AND:
+            if ((instr >> 5) & BOOL_BITMASK)
+            {
+                d->flags |= DEC_IMM;
+                d->imm = sign_extend(instr & 0x1F, 5);
+            }
+            break;
+        case OP_BR:
+        case OP_LD:
+        case OP_LDI:
+        case OP_LEA:
+        case OP_ST:
+        case OP_STI:
+            d->imm = sign_extend(instr & 0x1FF, 9);
+            /* PC-relative addresses are fixed, so sort out devices now */
+            if ((uint16_t)(address + 1 + d->imm) >= MR_IO)
+            {
+                if (d->op == OP_LD) d->op = OP_LD_IO;
+                if (d->op == OP_ST) d->op = OP_ST_IO;
+            }
+            break;
+        case OP_LDR:
+        case OP_STR:
+            d->imm = sign_extend(instr & 0x3F, 6);
+            break;
+        case OP_JSR:
+            if ((instr >> 11) & BOOL_BITMASK)
+            {
+                d->flags |= DEC_IMM;
+                d->imm = sign_extend(instr & 0x7FF, 11);
+            }
+            break;
+        case OP_TRAP:
+            d->imm = instr & 0xFF;
+            break;
     }
 
-    for (int j = 1; j < argc; ++j)
+    d->base = d->op;
+
+    /* the device registers change under us, so never cache them */
+    if (address < MR_IO)
     {
-        if (!read_image(argv[j]))
+        d->flags |= DEC_VALID;
+        if (vm->fuse && address + 1 < MR_IO)
         {
-            printf("failed to load image: %s\n", argv[j]);
-            exit(1);
+            fuse(d, vm->memory[address + 1]);
         }
     }
+}
 
-    signal(SIGINT, handle_interrupt);
-    disable_input_buffering();
+static inline struct decoded* fetch(struct vm* vm, uint16_t address)
+{
+    struct decoded* d = &vm->decoded[address];
+    if (!(d->flags & DEC_VALID))
+    {
+        decode(vm, address);
+    }
+    return d;
+}
+
+#if LC3_JIT
+#include "jit.c"
+#endif
+
+/* 0x3000 is the default starting position */
+enum { PC_START = 0x3000 };
+
+#include "traps.c"
+
+/* how a run ended, also the exit status */
+enum
+{
+    STOP_HALT = 0,
+    STOP_ERROR = 1,    /* an image, input or checkpoint could not be read or written */
+    STOP_BUDGET = 3,   /* ran out of instructions */
+    STOP_TIMEOUT = 4,  /* ran out of time */
+    /* only an embedded VM stops for these, see lib.c */
+    STOP_INPUT = 5,    /* waiting for a key that has not come */
+    STOP_TRAP = 6,     /* ran a TRAP the embedder handles */
+    STOP_FAULT = 7     /* ran a reserved opcode or an RTI with nothing to handle it */
+};
+
+/* a bad opcode or RTI: 0 to abort, as the command line does, or stop the run of an embedded VM */
+int vm_fault(struct vm* vm)
+{
+    if (!vm->embedder) return 0;
+    vm->stopped = STOP_FAULT;
+    vm->yield = 1;
+    return 1;
+}
+
+/* put `vm` back in its power-on state: memory cleared and nothing cached */
+void vm_reset(struct vm* vm)
+{
+    /* pages never written still hold zeros, decoded as zeros */
+    for (unsigned p = 0; p < PAGE_COUNT; ++p)
+    {
+        if (!page_populated(vm, p)) continue;
+        memset(vm->memory + p * PAGE_WORDS, 0, PAGE_WORDS * sizeof(*vm->memory));
+        memset(vm->decoded + p * PAGE_WORDS, 0, PAGE_WORDS * sizeof(*vm->decoded));
+        vm->decoded[(uint16_t)(p * PAGE_WORDS - 1)].flags = 0; /* may have fused with the first word */
+    }
+    memset(vm->reg, 0, sizeof(vm->reg));
+#if LC3_JIT
+    if (vm->jit)
+    {
+        jit_reset(vm);
+    }
+#endif
+    vm->kbd_empty_polls = 0;
 
     /* since exactly one condition flag should be set at any given time, set the Z flag */
-    reg[R_COND] = FL_ZRO;
+    vm->reg[R_COND] = FL_ZRO;
+    load_cond(vm);
 
     /* set the PC to starting position */
-    /* 0x3000 is the default */
-    enum { PC_START = 0x3000 };
-    reg[R_PC] = PC_START;
-
-    int running = 1;
-    while (running)
-    {
-        /* FETCH */
-        uint16_t instr = mem_read(reg[R_PC]++);
-        uint16_t op = instr >> 12;
-
-        switch (op)
-        {
-            case OP_ADD:
-                {
-                    uint16_t r0 = (instr >> 9) & R_BITMASK;
-                    uint16_t r1 = (instr >> 6) & R_BITMASK;
-                    uint16_t imm_flag = (instr >> 5) & BOOL_BITMASK;
-                    
-                    if (imm_flag)
-                    {
-                        uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-                        reg[r0] = reg[r1] + imm5;
-                    }
-                    else
-                    {
-                        uint16_t r2 = instr & R_BITMASK;
-                        reg[r0] = reg[r1] + reg[r2];
-                    }
-
-                    update_flags(r0);
-                }
-                break;
-
-            case OP_AND:
-                {
-                    uint16_t r0 = (instr >> 9) & R_BITMASK;
-                    uint16_t r1 = (instr >> 6) & R_BITMASK;
-                    uint16_t imm_flag = (instr >> 5) & BOOL_BITMASK;
-                    
-                    if (imm_flag)
-                    {
-                        uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-                        reg[r0] = reg[r1] & imm5;
-                    }
-                    else
-                    {
-                        uint16_t r2 = instr & R_BITMASK;
-                        reg[r0] = reg[r1] & reg[r2];
-                    }
-
-                    update_flags(r0);
-                }
-                break;
-            case OP_NOT:
-                {
-                    uint16_t r0 = (instr >> 9) & R_BITMASK;
-                    uint16_t r1 = (instr >> 6) & R_BITMASK;
-                    
-                    reg[r0] = ~reg[r1];
-
-                    update_flags(r0);
-                }
-                break;
-            case OP_BR:
-                {
-                    uint16_t n = (instr >> 11) & BOOL_BITMASK;
-                    uint16_t z = (instr >> 10) & BOOL_BITMASK;
-                    uint16_t p = (instr >> 9) & BOOL_BITMASK;
-
-                    if (n && (reg[R_COND] == FL_NEG) || z && (reg[R_COND] == FL_ZRO) || p && (reg[R_COND] == FL_POS))
-                    {
-                        uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-                        reg[R_PC] += pc_offset;
-                    }                            
-                }
-                break;
-            case OP_JMP:
-                {
-                    uint16_t base_r = (instr >> 6) & R_BITMASK;
-                    reg[R_PC] = reg[base_r];
-                }
-            
-                break;
-            case OP_JSR:
-                {
-                    reg[R_R7] = reg[R_PC];
-                    uint16_t flag = (instr >> 11) & BOOL_BITMASK;
-                    if (!flag)
-                    {
-                        uint16_t base_r = (instr >> 6) & R_BITMASK;
-                        reg[R_PC] = reg[base_r];
-                    } 
-                    else 
-                    {
-                        uint16_t pc_offset = sign_extend(instr & 0x7FF, 11);
-                        reg[R_PC] = pc_offset + reg[R_R7];
-                    }
-                }
-
-                break;
-            case OP_LD:
-                {
-                    uint16_t r0 = (instr >> 9) & R_BITMASK;
-                    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-
-                    reg[r0] = mem_read(reg[R_PC] + pc_offset);
-                    update_flags(r0);
-                }
-
-                break;
-            case OP_LDI:
-                {
-                    uint16_t r0 = (instr >> 9) & R_BITMASK;
-                    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-
-                    reg[r0] = mem_read(mem_read(reg[R_PC] + pc_offset));
-                    update_flags(r0);
-                }
-                break;
-
-            case OP_LDR:
-                {
-                    uint16_t r0 = (instr >> 9) & R_BITMASK;
-                    uint16_t base_r = (instr >> 6) & R_BITMASK;
-                    uint16_t offset = sign_extend(instr & 0x3F, 6);
-
-                    reg[r0] = mem_read(reg[base_r] + offset);
-                    update_flags(r0);
-                }
-
-                break;
-            case OP_LEA:
-                {
-                    uint16_t r0 = (instr >> 9) & R_BITMASK;
-                    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-
-                    reg[r0] = reg[R_PC] + pc_offset;
-                    update_flags(r0);
-                }
-
-                break;
-            case OP_ST:
-                {
-                    uint16_t sr = (instr >> 9) & R_BITMASK;
-                    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-                    
-                    mem_write(reg[R_PC] + pc_offset, reg[sr]);
-                }
-
-                break;
-            case OP_STI:
-                {
-                    uint16_t sr = (instr >> 9) & R_BITMASK;
-                    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-                    
-                    mem_write(mem_read(reg[R_PC] + pc_offset), reg[sr]);
-                }
-
-                break;
-            case OP_STR:
-                {
-                    uint16_t sr = (instr >> 9) & R_BITMASK;
-                    uint16_t base_r = (instr >> 6) & R_BITMASK;
-                    uint16_t offset = sign_extend(instr & 0x3F, 6);
-
-                    mem_write(reg[base_r] + offset, reg[sr]);
-                }
-
-                break;
-            case OP_TRAP:
-                reg[R_R7] = reg[R_PC];
-
-                switch (instr & 0xFF)
-                {
-                    case TRAP_GETC:
-                        {
-                            reg[R_R0] = (uint16_t) getchar();
-                            update_flags(R_R0);
-                        }
-
-                        break;
-                    case TRAP_OUT:
-                        {
-                            char c = reg[R_R0];
-                            putc(c, stdout);
-                            fflush(stdout);
-                        }
-
-                        break;
-                    case TRAP_PUTS:
-                        {
-                            uint16_t* c = memory + reg[R_R0];
-                            while (*c)
-                            {
-                                putc((char)*c, stdout);
-                                ++c;
-                            }
-                            fflush(stdout);
-                        }
-
-                        break;
-                    case TRAP_IN:
-                        {
-                            printf("Enter a character: ");
-
-                            char c = (uint16_t) getchar();
-                            putc(c, stdout);
-                            fflush(stdout);
-                            reg[R_R0] = (uint16_t)c;
-
-                            update_flags(R_R0);
-                        }
-
-                        break;
-                    case TRAP_PUTSP:
-                        {
-                            uint16_t* c = memory + reg[R_R0];
-                            while (*c)
-                            {
-                                char char1 = (*c) & 0xFF;
-                                putc(char1, stdout);
-                                char char2 = (*c) >> 8;
-                                if (char2) putc(char2, stdout);
-                                ++c;
-                            }
-                            fflush(stdout);
-                        }
-
-                        break;
-                    case TRAP_HALT:
-                        {
-                            puts("HALT");
-                            fflush(stdout);
-                        }
-                        break;
-                }
-                break;
-            case OP_RES:
-            case OP_RTI:
-            default:
-                abort();
-                break;
-        }
+    vm->reg[R_PC] = PC_START;
+    vm->running = 1;
+    vm->instructions = 0;
+    pages_clear(vm);
+    interrupts_reset(vm);
+}
+
+/*
+ * a machine reading keys from `kbd` and writing to `console`, memory comes
+ * from calloc so pages the guest never touches are never cleared
+ */
+struct vm* vm_create(struct kbd_fifo* kbd, struct console* console)
+{
+    struct vm* vm = calloc(1, sizeof(*vm));
+    if (!vm) return NULL;
+    vm->memory = calloc(MEMORY_MAX, sizeof(*vm->memory));
+    vm->decoded = calloc(MEMORY_MAX, sizeof(*vm->decoded));
+    if (!vm->memory || !vm->decoded)
+    {
+        free(vm->memory);
+        free(vm->decoded);
+        free(vm);
+        return NULL;
     }
-    restore_input_buffering();
+    vm->kbd = kbd;
+    vm->console = console;
+    vm->fuse = 1;
+    set_traps(vm, TRAPS_NATIVE);
+    vm->store_hooks = hooks_none;
+
+    vm->reg[R_COND] = FL_ZRO;
+    load_cond(vm);
+    vm->reg[R_PC] = PC_START;
+    vm->running = 1;
+    pages_clear(vm);
+    interrupts_reset(vm);
+    return vm;
+}
+
+void vm_free_memory(struct vm* vm)
+{
+    if (vm->view)
+    {
+        unmap_copy(vm->view, vm->view_size);
+        vm->view = NULL;
+    }
+    else
+    {
+        free(vm->memory);
+        free(vm->decoded);
+    }
+    vm->memory = NULL;
+    vm->decoded = NULL;
+}
+
+void vm_destroy(struct vm* vm)
+{
+#if LC3_JIT
+    jit_destroy(vm);
+#endif
+    vm_free_memory(vm);
+    if (vm->store_hooks != hooks_none)
+    {
+        free(vm->store_hooks);
+    }
+    free(vm);
 }
+
+/*
+ * A snapshot is a loaded machine written to a file: a header with the
+ * registers, then memory[] and decoded[] at fixed offsets. VMs started from
+ * it map the file copy-on-write, so they share every page they do not write
+ * and start with the decode cache already filled. The file can be a
+ * temporary one for a single process or a named one that many processes
+ * map at once. Only populated pages are written; the rest are holes that
+ * read back as zeros, and the header says which ones they are.
+ */
+#define SNAPSHOT_MEMORY 4096 /* offset of memory[], decoded[] follows it */
+#define SNAPSHOT_DECODED (SNAPSHOT_MEMORY + MEMORY_MAX * sizeof(uint16_t))
+#define SNAPSHOT_SIZE (SNAPSHOT_DECODED + MEMORY_MAX * sizeof(struct decoded))
+
+struct snapshot_header
+{
+    char magic[4];          /* "LC3S" */
+    uint32_t decoded_size;  /* sizeof(struct decoded) of the writer */
+    uint16_t reg[R_COUNT];
+    uint32_t flags;         /* SNAPSHOT_PAGES if `populated` is filled in */
+    uint8_t populated[PAGE_COUNT];
+};
+
+#define SNAPSHOT_PAGES (1 << 0) /* without it, older files count every page as populated */
+
+struct snapshot
+{
+    FILE* file;
+};
+
+/* write `vm` to `path`, or to a temporary file if `path` is NULL */
+int snapshot_create(struct snapshot* snap, struct vm* vm, const char* path)
+{
+    static const uint8_t zero[SNAPSHOT_MEMORY];
+    struct snapshot_header header = { { 'L', 'C', '3', 'S' }, sizeof(struct decoded) };
+    sync_cond(vm);
+    memcpy(header.reg, vm->reg, sizeof(header.reg));
+    header.flags = SNAPSHOT_PAGES;
+    for (unsigned p = 0; p < PAGE_COUNT; ++p)
+    {
+        header.populated[p] = (uint8_t)page_populated(vm, p);
+    }
+
+    snap->file = path ? fopen(path, "w+b") : tmpfile();
+    if (!snap->file)
+    {
+        return 0;
+    }
+    int ok = fwrite(&header, sizeof(header), 1, snap->file) == 1
+             && fwrite(zero, SNAPSHOT_MEMORY - sizeof(header), 1, snap->file) == 1;
+
+    /* the device page is always populated and comes last, so the file still ends at SNAPSHOT_SIZE */
+    for (size_t p = 0; p < PAGE_COUNT && ok; ++p)
+    {
+        if (!header.populated[p]) continue;
+        size_t word = p * PAGE_WORDS;
+        ok = fseek(snap->file, (long)(SNAPSHOT_MEMORY + word * sizeof(uint16_t)), SEEK_SET) == 0
+             && fwrite(vm->memory + word, sizeof(uint16_t), PAGE_WORDS, snap->file) == PAGE_WORDS
+             && fseek(snap->file, (long)(SNAPSHOT_DECODED + word * sizeof(struct decoded)), SEEK_SET) == 0
+             && fwrite(vm->decoded + word, sizeof(struct decoded), PAGE_WORDS, snap->file) == PAGE_WORDS;
+    }
+    if (!ok || fflush(snap->file) != 0)
+    {
+        fclose(snap->file);
+        return 0;
+    }
+    return 1;
+}
+
+int snapshot_open(struct snapshot* snap, const char* path)
+{
+    struct snapshot_header header;
+    snap->file = fopen(path, "rb");
+    if (!snap->file)
+    {
+        return 0;
+    }
+    if (fread(&header, sizeof(header), 1, snap->file) != 1
+        || memcmp(header.magic, "LC3S", 4) != 0
+        || header.decoded_size != sizeof(struct decoded)
+        || fseek(snap->file, 0, SEEK_END) != 0
+        || ftell(snap->file) != (long)SNAPSHOT_SIZE)
+    {
+        fclose(snap->file);
+        return 0;
+    }
+    return 1;
+}
+
+/* throw away the state of `vm` and continue from `snap` */
+int vm_restore(struct vm* vm, struct snapshot* snap)
+{
+    uint8_t* view = map_copy(snap->file, SNAPSHOT_SIZE);
+    if (!view)
+    {
+        return 0;
+    }
+    vm_free_memory(vm);
+    vm->view = view;
+    vm->view_size = SNAPSHOT_SIZE;
+    vm->memory = (uint16_t*)(view + SNAPSHOT_MEMORY);
+    vm->decoded = (struct decoded*)(view + SNAPSHOT_DECODED);
+
+    const struct snapshot_header* header = (const struct snapshot_header*)view;
+    memcpy(vm->reg, header->reg, sizeof(vm->reg));
+    memset(vm->dirty, 0, sizeof(vm->dirty));
+    memset(vm->populated, 0, sizeof(vm->populated));
+    for (unsigned p = 0; p < PAGE_COUNT; ++p)
+    {
+        if (!(header->flags & SNAPSHOT_PAGES) || header->populated[p])
+        {
+            vm->populated[p / 64] |= (uint64_t)1 << (p % 64);
+        }
+    }
+    load_cond(vm);
+#if LC3_JIT
+    if (vm->jit)
+    {
+        jit_reset(vm);
+    }
+#endif
+    vm->kbd_empty_polls = 0;
+    vm->running = 1;
+    vm->instructions = 0;
+    interrupts_reset(vm);
+    return 1;
+}
+
+/* threaded dispatch needs labels as values, so MSVC gets the switch */
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(_WIN32) && !defined(LC3_DISPATCH_SWITCH)
+#define LC3_THREADED 1
+#else
+#define LC3_THREADED 0
+#endif
+
+#include "profile.c"
+#include "trace.c"
+#include "debug.c"
+#ifdef LC3_FUZZ
+#include "coverage.c"
+#endif
+
+#define INTERP_NAME run_switch_budget
+#define INTERP_THREADED 0
+#define INTERP_BUDGET 1
+#define INTERP_BLOCKS 0
+#define INTERP_JIT 0
+#define INTERP_PROFILE 0
+#define INTERP_TRACE 0
+#define INTERP_DEBUG 0
+#define INTERP_COVERAGE 0
+#include "interp.c"
+
+#if LC3_THREADED
+#define INTERP_NAME run_threaded_budget
+#define INTERP_THREADED 1
+#define INTERP_BUDGET 1
+#define INTERP_BLOCKS 0
+#define INTERP_JIT 0
+#define INTERP_PROFILE 0
+#define INTERP_TRACE 0
+#define INTERP_DEBUG 0
+#define INTERP_COVERAGE 0
+#include "interp.c"
+#endif
+
+#define INTERP_NAME run_profile
+#define INTERP_THREADED LC3_THREADED
+#define INTERP_BUDGET 1
+#define INTERP_BLOCKS 0
+#define INTERP_JIT 0
+#define INTERP_PROFILE 1
+#define INTERP_TRACE 0
+#define INTERP_DEBUG 0
+#define INTERP_COVERAGE 0
+#include "interp.c"
+
+#define INTERP_NAME run_trace
+#define INTERP_THREADED LC3_THREADED
+#define INTERP_BUDGET 1
+#define INTERP_BLOCKS 0
+#define INTERP_JIT 0
+#define INTERP_PROFILE 0
+#define INTERP_TRACE 1
+#define INTERP_DEBUG 0
+#define INTERP_COVERAGE 0
+#include "interp.c"
+
+#if LC3_JIT
+#define INTERP_NAME run_jit_budget
+#define INTERP_THREADED LC3_THREADED
+#define INTERP_BUDGET 1
+#define INTERP_BLOCKS 0
+#define INTERP_JIT 1
+#define INTERP_PROFILE 0
+#define INTERP_TRACE 0
+#define INTERP_DEBUG 0
+#define INTERP_COVERAGE 0
+#include "interp.c"
+#endif
+
+#define INTERP_NAME run_debug
+#define INTERP_THREADED LC3_THREADED
+#define INTERP_BUDGET 1
+#define INTERP_BLOCKS 0
+#define INTERP_JIT 0
+#define INTERP_PROFILE 0
+#define INTERP_TRACE 0
+#define INTERP_DEBUG 1
+#define INTERP_COVERAGE 0
+#include "interp.c"
+
+#ifdef LC3_FUZZ
+#define INTERP_NAME run_coverage
+#define INTERP_THREADED LC3_THREADED
+#define INTERP_BUDGET 1
+#define INTERP_BLOCKS 0
+#define INTERP_JIT 0
+#define INTERP_PROFILE 0
+#define INTERP_TRACE 0
+#define INTERP_DEBUG 0
+#define INTERP_COVERAGE 1
+#include "interp.c"
+#endif
+
+#define BLOCKS_TAIL MEMORY_MAX /* longer than any block */
+
+#define INTERP_NAME run_switch_blocks
+#define INTERP_THREADED 0
+#define INTERP_BUDGET 1
+#define INTERP_BLOCKS 1
+#define INTERP_JIT 0
+#define INTERP_PROFILE 0
+#define INTERP_TRACE 0
+#define INTERP_DEBUG 0
+#define INTERP_COVERAGE 0
+#include "interp.c"
+
+#if LC3_THREADED
+#define INTERP_NAME run_threaded_blocks
+#define INTERP_THREADED 1
+#define INTERP_BUDGET 1
+#define INTERP_BLOCKS 1
+#define INTERP_JIT 0
+#define INTERP_PROFILE 0
+#define INTERP_TRACE 0
+#define INTERP_DEBUG 0
+#define INTERP_COVERAGE 0
+#include "interp.c"
+#endif
+
+#if LC3_JIT
+#define INTERP_NAME run_jit_blocks
+#define INTERP_THREADED LC3_THREADED
+#define INTERP_BUDGET 1
+#define INTERP_BLOCKS 1
+#define INTERP_JIT 1
+#define INTERP_PROFILE 0
+#define INTERP_TRACE 0
+#define INTERP_DEBUG 0
+#define INTERP_COVERAGE 0
+#include "interp.c"
+#endif
+
+/* an interpreter, or the JIT behind one */
+typedef void (*run_fn)(struct vm* vm);
+
+/*
+ * Run vm->budget instructions counting a block at a time, then the last
+ * BLOCKS_TAIL or fewer one at a time, so the run still stops exactly.
+ */
+void run_counted(struct vm* vm, run_fn blocks, run_fn exact)
+{
+    blocks(vm);
+    if (vm->budget && vm->running && !vm->yield && !vm->idle)
+    {
+        exact(vm);
+    }
+}
+
+void run_switch_counted(struct vm* vm)
+{
+    run_counted(vm, run_switch_blocks, run_switch_budget);
+}
+
+#if LC3_THREADED
+void run_threaded_counted(struct vm* vm)
+{
+    run_counted(vm, run_threaded_blocks, run_threaded_budget);
+}
+#endif
+
+#if LC3_JIT
+void run_jit_counted(struct vm* vm)
+{
+    run_counted(vm, run_jit_blocks, run_jit_budget);
+}
+#endif
+
+/* what an engine does besides running the guest, each picks a different instantiation */
+enum
+{
+    ENGINE_JIT = 1 << 0,
+    ENGINE_PROFILE = 1 << 1,
+    ENGINE_TRACE = 1 << 2,
+    ENGINE_DEBUG = 1 << 3
+};
+
+/* the engines that stop after vm->budget instructions, by the features they have */
+struct engine
+{
+    unsigned features;
+    run_fn run;
+};
+
+const struct engine engines[] =
+{
+#if LC3_THREADED
+    { 0, run_threaded_counted },
+#else
+    { 0, run_switch_counted },
+#endif
+#if LC3_JIT
+    { ENGINE_JIT, run_jit_counted },
+#endif
+    { ENGINE_PROFILE, run_profile },
+    { ENGINE_TRACE, run_trace },
+    { ENGINE_DEBUG, run_debug },
+};
+
+/*
+ * The engine with exactly `features`, so a run without instrumentation gets
+ * an interpreter with no instrumentation in it. The instrumented ones see
+ * every instruction and never translate, so they may drop ENGINE_JIT.
+ * Returns NULL if no engine has the combination.
+ */
+run_fn engine_select(unsigned features)
+{
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i)
+    {
+        if (engines[i].features == features)
+        {
+            return engines[i].run;
+        }
+    }
+    if (features & ENGINE_JIT && features != ENGINE_JIT)
+    {
+        return engine_select(features & ~ENGINE_JIT);
+    }
+    return NULL;
+}
+
+#include "bench.c"
+
+const char* stop_names[] = { "halted", "error", NULL, "budget", "timeout", "input", "trap", "fault" };
+
+#define BATCH_SLICE (1 << 22) /* instructions between clock checks */
+#define BATCH_GRACE_NS 100000000 /* before the watchdog ends a run stuck past its timeout */
+
+/*
+ * run until HALT, `max_instructions` or the clock reaches `deadline`,
+ * whichever comes first; zero instructions means no limit
+ */
+int run_limited(struct vm* vm, run_fn run_budget, uint64_t max_instructions, uint64_t deadline,
+                uint64_t* executed)
+{
+    *executed = 0;
+    while (vm->running)
+    {
+        uint64_t slice = BATCH_SLICE;
+        if (max_instructions && max_instructions - *executed < slice)
+        {
+            slice = max_instructions - *executed;
+            if (slice == 0) return STOP_BUDGET;
+        }
+
+        if (vm->record)
+        {
+            record_poll(vm);
+            if (slice > RECORD_SLICE) slice = RECORD_SLICE;
+        }
+
+        /* stop for the next event, so it happens on its instruction */
+        events_run(vm);
+        if (vm->event_count && vm->events[0].when - vm->instructions < slice)
+        {
+            slice = vm->events[0].when - vm->instructions;
+        }
+
+        if (vm->display && slice > DISPLAY_SLICE)
+        {
+            slice = DISPLAY_SLICE;
+        }
+
+        vm->budget = slice;
+        run_budget(vm);
+        slice -= vm->budget;
+        *executed += slice;
+        vm->instructions += slice;
+
+        if (vm->yield)
+        {
+            vm->yield = 0;
+            devices_sync(vm);
+        }
+        if (vm->stopped) return vm->stopped;
+        if (vm->idle)
+        {
+            if (vm->embedder && !vm->event_count)
+            {
+                /* nothing can happen until the embedder has keys, see kbsr_read() */
+                vm->idle = 0;
+                interrupts_update(vm);
+                return STOP_INPUT;
+            }
+            *executed += interrupt_wait(vm, max_instructions ? max_instructions - *executed : UINT64_MAX);
+        }
+        if (vm->display) display_tick(vm);
+        if (vm->debug && vm->debug->stop) return STOP_BUDGET; /* gdb_resume() looks at why */
+        if (vm->running && clock_ns() >= deadline) return STOP_TIMEOUT;
+        if (interrupt_pending) interrupt_exit();
+    }
+    return STOP_HALT;
+}
+
+#include "checkpoint.c"
+
+/* with --checkpoint-every, run_saving() saves to checkpoint_path on the way */
+const char* checkpoint_path;
+uint64_t checkpoint_every;
+struct checkpoint_cache* checkpoint_cache;
+
+/* run_limited(), stopping every checkpoint_every instructions to save a checkpoint */
+int run_saving(struct vm* vm, run_fn run_budget, uint64_t max_instructions, uint64_t deadline,
+               uint64_t* executed)
+{
+    if (!checkpoint_every)
+    {
+        return run_limited(vm, run_budget, max_instructions, deadline, executed);
+    }
+    uint64_t total = 0;
+    for (;;)
+    {
+        uint64_t part = checkpoint_every;
+        if (max_instructions && max_instructions - total < part)
+        {
+            part = max_instructions - total;
+        }
+        int status = run_limited(vm, run_budget, part, deadline, executed);
+        total += *executed;
+        *executed = total;
+        if (status != STOP_BUDGET || total == max_instructions)
+        {
+            return status;
+        }
+        if (!checkpoint_save_cached(vm, checkpoint_path, checkpoint_cache))
+        {
+            fprintf(stderr, "failed to save checkpoint: %s\n", checkpoint_path);
+        }
+    }
+}
+
+int batch;
+struct vm* batch_vm;
+uint64_t batch_start;
+uint64_t batch_executed;
+atomic_int batch_done;
+
+/* print the outcome of a batch run once, whoever gets here first */
+void batch_report(int status)
+{
+    if (atomic_exchange(&batch_done, 1)) return;
+    if (batch)
+    {
+        fprintf(stderr, "{\"status\": \"%s\", \"instructions\": %llu, \"seconds\": %.6f, \"pc\": %u}\n",
+                stop_names[status], (unsigned long long)batch_executed,
+                (clock_ns() - batch_start) / 1e9, batch_vm->reg[R_PC]);
+    }
+}
+
+/* the guest is stuck waiting for input that never comes */
+void batch_watchdog()
+{
+    if (atomic_load(&batch_done)) return;
+    console_flush(batch_vm->console);
+    batch_report(STOP_TIMEOUT);
+    restore_input_buffering();
+    _exit(STOP_TIMEOUT);
+}
+
+/* run_limited() for the one VM of a batch run, `timeout` in seconds */
+int batch_run(struct vm* vm, run_fn run_budget, uint64_t max_instructions, double timeout)
+{
+    batch_vm = vm;
+    batch_start = clock_ns();
+    uint64_t deadline = UINT64_MAX;
+    if (timeout > 0)
+    {
+        deadline = batch_start + (uint64_t)(timeout * 1e9);
+        watchdog_start((uint64_t)(timeout * 1e9) + BATCH_GRACE_NS, batch_watchdog);
+    }
+    return run_saving(vm, run_budget, max_instructions, deadline, &batch_executed);
+}
+
+#include "loader.c"
+
+/* load a comma separated list of images, IMAGE_* of the first failure */
+int read_images(struct vm* vm, const char* list, int parallel)
+{
+    size_t size = strlen(list) + 1;
+    char* copy = malloc(size);
+    const char** paths = malloc(size * sizeof(*paths));
+    int result = IMAGE_UNREADABLE;
+    if (copy && paths)
+    {
+        memcpy(copy, list, size);
+        int count = 0;
+        for (char* p = copy; *p; )
+        {
+            paths[count++] = p;
+            p += strcspn(p, ",");
+            if (*p) *p++ = '\0';
+        }
+        int failed;
+        result = load_images(vm, paths, count, parallel, &failed);
+    }
+    free(copy);
+    free(paths);
+    return result;
+}
+
+#include "cfg.c"
+#include "runner.c"
+#include "serve.c"
+#include "gdb.c"
+
+#ifdef LC3_FUZZ
+#include "fuzz.c"
+#elif defined(LC3_LIBRARY)
+#include "lib.c"
+#else
+
+/* the value of `--name=value`, or NULL if `arg` is some other option */
+const char* option_value(const char* arg, const char* name)
+{
+    size_t n = strlen(name);
+    return strncmp(arg, name, n) == 0 && arg[n] == '=' ? arg + n + 1 : NULL;
+}
+
+/* load `images` on top of `base` (if any) and snapshot the result to a temporary file */
+int preload(struct snapshot* snap, struct snapshot* base, const char* images)
+{
+    struct vm* vm = vm_create(NULL, NULL);
+    int ok = vm && (!base || vm_restore(vm, base)) && read_images(vm, images, 1) == IMAGE_OK
+        && cfg_prepare(vm) && snapshot_create(snap, vm, NULL);
+    if (vm)
+    {
+        vm_destroy(vm);
+    }
+    return ok;
+}
+
+int main(int argc, const char* argv[])
+{
+    uint64_t bench_count = 0;
+    uint64_t suite_count = 0;
+    uint64_t max_instructions = 0;
+    double timeout = 0;
+    const char* input = NULL;
+    const char* input_script = NULL;
+    const char* record = NULL;
+    const char* snapshot = NULL;
+    const char* save_snapshot = NULL;
+    const char* preload_images = NULL;
+    const char* convert = NULL;
+    const char* checkpoint = NULL;
+    const char* profile = NULL;
+    const char* trace = NULL;
+    const char* trace_dump_path = NULL;
+    uint32_t trace_entries = TRACE_ENTRIES;
+    const char* restore = NULL;
+    const char* gdb = NULL;
+    const char* serve = NULL;
+    const char* value;
+    int jit = 0;
+    int traps = TRAPS_NATIVE;
+    int buffered = 0;
+    int print_cfg = 0;
+    unsigned display_fps = 0;
+    int workers = 0;
+    int first = 1;
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; ++first)
+    {
+        if (strncmp(argv[first], "--bench-suite", 13) == 0)
+        {
+            suite_count = argv[first][13] == '=' ? strtoull(argv[first] + 14, NULL, 10) : BENCH_SUITE_INSTRUCTIONS;
+            if (suite_count == 0) break;
+        }
+        else if (strncmp(argv[first], "--bench", 7) == 0)
+        {
+            bench_count = argv[first][7] == '=' ? strtoull(argv[first] + 8, NULL, 10) : BENCH_INSTRUCTIONS;
+            if (bench_count == 0) break;
+        }
+        else if (strncmp(argv[first], "--display", 9) == 0 && (argv[first][9] == '=' || !argv[first][9]))
+        {
+            display_fps = argv[first][9] == '=' ? (unsigned)strtoul(argv[first] + 10, NULL, 10) : DISPLAY_FPS;
+            if (display_fps == 0) break;
+        }
+        else if (strcmp(argv[first], "--jit") == 0)
+        {
+            jit = 1;
+        }
+        else if (strcmp(argv[first], "--buffered") == 0)
+        {
+            buffered = 1;
+        }
+        else if (strcmp(argv[first], "--cfg") == 0)
+        {
+            print_cfg = 1;
+        }
+        else if (strcmp(argv[first], "--batch") == 0)
+        {
+            batch = 1;
+        }
+        else if (strcmp(argv[first], "--parallel") == 0)
+        {
+            workers = cpu_count();
+        }
+        else if ((value = option_value(argv[first], "--parallel")))
+        {
+            workers = atoi(value);
+            if (workers <= 0) break;
+        }
+        else if ((value = option_value(argv[first], "--input")))
+        {
+            input = value;
+        }
+        else if ((value = option_value(argv[first], "--input-script")))
+        {
+            input_script = value;
+        }
+        else if ((value = option_value(argv[first], "--record")))
+        {
+            record = value;
+        }
+        else if ((value = option_value(argv[first], "--serve")))
+        {
+            serve = value;
+        }
+        else if ((value = option_value(argv[first], "--snapshot")))
+        {
+            snapshot = value;
+        }
+        else if ((value = option_value(argv[first], "--save-snapshot")))
+        {
+            save_snapshot = value;
+        }
+        else if ((value = option_value(argv[first], "--profile")))
+        {
+            profile = value;
+        }
+        else if ((value = option_value(argv[first], "--traps")))
+        {
+            for (traps = 0; traps <= TRAPS_AUTO && strcmp(value, trap_modes[traps]) != 0; ++traps);
+            if (traps > TRAPS_AUTO)
+            {
+                printf("unknown --traps mode: %s\n", value);
+                exit(2);
+            }
+        }
+        else if ((value = option_value(argv[first], "--trace")))
+        {
+            trace = value;
+        }
+        else if ((value = option_value(argv[first], "--trace-size")))
+        {
+            trace_entries = (uint32_t) strtoul(value, NULL, 10);
+        }
+        else if ((value = option_value(argv[first], "--trace-dump")))
+        {
+            trace_dump_path = value;
+        }
+        else if ((value = option_value(argv[first], "--checkpoint")))
+        {
+            checkpoint = value;
+        }
+        else if ((value = option_value(argv[first], "--checkpoint-every")))
+        {
+            checkpoint_every = strtoull(value, NULL, 10);
+            if (checkpoint_every == 0) break;
+        }
+        else if ((value = option_value(argv[first], "--restore")))
+        {
+            restore = value;
+        }
+        else if ((value = option_value(argv[first], "--gdb")))
+        {
+            gdb = value;
+        }
+        else if ((value = option_value(argv[first], "--convert")))
+        {
+            convert = value;
+        }
+        else if ((value = option_value(argv[first], "--preload")))
+        {
+            preload_images = value;
+        }
+        else if ((value = option_value(argv[first], "--max-instructions")))
+        {
+            max_instructions = strtoull(value, NULL, 10);
+        }
+        else if ((value = option_value(argv[first], "--timeout")))
+        {
+            timeout = strtod(value, NULL);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if ((argc <= first && !snapshot && !preload_images && !restore && !suite_count && !trace_dump_path) || (first < argc && strncmp(argv[first], "--", 2) == 0))
+    {
+        /* show usage string */
+        printf("lc3 [--bench[=instructions]] [--jit] [--buffered] [--batch] [--input=file]\n"
+               "    [--input-script=file] [--record=file] [--traps=native|guest|auto]\n"
+               "    [--max-instructions=count] [--timeout=seconds] [--snapshot=file]\n"
+               "    [--preload=image[,image...]] [--save-snapshot=file] [--restore=checkpoint]\n"
+               "    [--checkpoint=file] [--checkpoint-every=instructions]\n"
+               "    [--profile=folded-file] [--trace=file]\n"
+               "    [--trace-size=entries] [--gdb=port|socket-path] [--display[=fps]]\n"
+               "    [image-file1] ...\n"
+               "lc3 --convert=cached-file image-file\n"
+               "lc3 --bench-suite[=instructions]\n"
+               "lc3 --trace-dump=trace-file\n"
+               "lc3 --cfg [--snapshot=file] [--restore=checkpoint] [image-file1] ...\n"
+               "lc3 --parallel[=workers] [--jit] [--traps=mode] [--input=file] [--input-script=file]\n"
+               "    [--max-instructions=count] [--timeout=seconds] [--snapshot=file]\n"
+               "    [--preload=image[,image...]]\n"
+               "    image[,image...] ...\n"
+               "lc3 --serve=port|socket-path [--traps=mode] [--max-instructions=count]\n"
+               "    [--snapshot=file] [--preload=image[,image...]] [image-file1] ...\n");
+        exit(2);
+    }
+
+    if (trace_dump_path)
+    {
+        int result = trace_dump(trace_dump_path);
+        if (result != IMAGE_OK)
+        {
+            printf("failed to read trace: %s %s\n", trace_dump_path, image_errors[result]);
+            exit(1);
+        }
+        return 0;
+    }
+
+#if !LC3_JIT
+    if (jit)
+    {
+        printf("the JIT is not available on this platform\n");
+        exit(2);
+    }
+#endif
+
+    /* picked once, the loop that runs has only the checks these flags need */
+    run_fn engine = engine_select((jit ? ENGINE_JIT : 0) | (profile ? ENGINE_PROFILE : 0)
+                                  | (trace ? ENGINE_TRACE : 0) | (gdb ? ENGINE_DEBUG : 0));
+    if (!engine)
+    {
+        printf("--profile, --trace and --gdb cannot be combined\n");
+        exit(2);
+    }
+    if (display_fps && (bench_count || workers))
+    {
+        printf("--display only shows a single run\n");
+        exit(2);
+    }
+    if (gdb && (profile || trace || bench_count || workers || batch || max_instructions || timeout > 0))
+    {
+        printf("--gdb only runs one image set interactively\n");
+        exit(2);
+    }
+    if (checkpoint_every && (!checkpoint || profile || trace || bench_count || workers))
+    {
+        printf("--checkpoint-every needs --checkpoint and a plain or batch run\n");
+        exit(2);
+    }
+    if (checkpoint_every)
+    {
+        checkpoint_path = checkpoint;
+        checkpoint_cache = calloc(1, sizeof(*checkpoint_cache));
+        if (!checkpoint_cache)
+        {
+            printf("out of memory\n");
+            exit(1);
+        }
+    }
+    if (record && (input_script || bench_count || workers))
+    {
+        printf("--record takes the keys of a single run from the terminal or --input\n");
+        exit(2);
+    }
+    if (serve && (jit || input || input_script || record || checkpoint || restore || profile || trace || gdb
+                  || bench_count || workers || display_fps || batch || timeout > 0 || save_snapshot || print_cfg))
+    {
+        printf("--serve takes every VM's input from its connection and only combines with --traps,\n"
+               "--max-instructions, --snapshot and --preload\n");
+        exit(2);
+    }
+    if (input && input_script)
+    {
+        printf("--input and --input-script cannot be combined\n");
+        exit(2);
+    }
+
+    if (convert)
+    {
+        if (argc - first != 1)
+        {
+            printf("--convert takes one image\n");
+            exit(2);
+        }
+        int result = convert_image(argv[first], convert);
+        if (result != IMAGE_OK)
+        {
+            printf("failed to convert image: %s %s\n", argv[first], image_errors[result]);
+            exit(1);
+        }
+        return 0;
+    }
+
+    devices_init();
+    stdout_console.out = stdout;
+    stdout_console.fully_buffered = buffered;
+    signal(SIGINT, handle_interrupt);
+
+    if (suite_count)
+    {
+        return bench_suite(suite_count);
+    }
+
+    /* every VM starts from `base` when there is one */
+    struct snapshot snapshots[2];
+    struct snapshot* base = NULL;
+    if (snapshot)
+    {
+        if (!snapshot_open(&snapshots[0], snapshot))
+        {
+            printf("failed to load snapshot: %s\n", snapshot);
+            exit(1);
+        }
+        base = &snapshots[0];
+    }
+    if (preload_images)
+    {
+        if (!preload(&snapshots[1], base, preload_images))
+        {
+            printf("failed to preload: %s\n", preload_images);
+            exit(1);
+        }
+        base = &snapshots[1];
+    }
+
+    if (workers)
+    {
+        if (argc <= first)
+        {
+            printf("no images to run\n");
+            exit(2);
+        }
+        return runner_main(workers, argv + first, argc - first, base, input, input_script, jit, traps,
+                           max_instructions, timeout);
+    }
+    if (serve)
+    {
+        return serve_main(serve, argv + first, argc - first, base, traps, max_instructions);
+    }
+
+    /* a scripted run gets a keyboard of its own, stdin is not read */
+    struct kbd_fifo script_kbd;
+    kbd_init_keys(&script_kbd, NULL, 0);
+    struct record* recording = NULL;
+    if (record && !(recording = record_create(record, &stdin_kbd)))
+    {
+        printf("failed to open the recording: %s\n", record);
+        exit(1);
+    }
+    struct vm* vm = vm_create(input_script ? &script_kbd : recording ? &recording->kbd : &stdin_kbd,
+                              &stdout_console);
+    if (!vm || (base && !vm_restore(vm, base)))
+    {
+        printf("out of memory\n");
+        exit(1);
+    }
+#if LC3_JIT
+    if ((jit || bench_count) && !jit_init(vm))
+    {
+        printf("failed to set up the JIT\n");
+        exit(1);
+    }
+#endif
+
+    if (restore)
+    {
+        int result = checkpoint_restore(vm, restore);
+        if (result != IMAGE_OK)
+        {
+            printf("failed to restore checkpoint: %s %s\n", restore, image_errors[result]);
+            exit(1);
+        }
+    }
+
+    int failed;
+    int result = load_images(vm, argv + first, argc - first, 1, &failed);
+    if (result != IMAGE_OK)
+    {
+        printf("failed to load image: %s %s\n", argv[first + failed], image_errors[result]);
+        exit(1);
+    }
+
+    set_traps(vm, traps);
+
+    if (print_cfg)
+    {
+        struct cfg* g = cfg_build(vm, vm->reg[R_PC]);
+        if (!g)
+        {
+            printf("out of memory\n");
+            exit(1);
+        }
+        cfg_print(g, stdout);
+        cfg_free(g);
+        return 0;
+    }
+    if (!cfg_prepare(vm))
+    {
+        printf("out of memory\n");
+        exit(1);
+    }
+
+    if (save_snapshot)
+    {
+        struct snapshot saved;
+        if (!snapshot_create(&saved, vm, save_snapshot))
+        {
+            printf("failed to save snapshot: %s\n", save_snapshot);
+            exit(1);
+        }
+        fclose(saved.file);
+        return 0;
+    }
+
+    if (input && !input_from_file(input))
+    {
+        printf("failed to open input: %s\n", input);
+        exit(1);
+    }
+    if (input_script)
+    {
+        struct script* s = script_read(input_script);
+        uint16_t* keys = s ? malloc((s->count ? s->count : 1) * sizeof(*keys)) : NULL;
+        if (!keys)
+        {
+            printf("failed to read input script: %s\n", input_script);
+            exit(1);
+        }
+        script_start(vm, s, keys);
+    }
+    vm->record = recording;
+
+    if (!batch)
+    {
+        disable_input_buffering();
+    }
+    if (!input_script)
+    {
+        input_start();
+    }
+    if (display_fps)
+    {
+        vm->display = display_create(stdout, display_fps);
+        if (!vm->display)
+        {
+            printf("out of memory\n");
+            exit(1);
+        }
+        display_vm = vm;
+        interrupt_hook = display_interrupted;
+    }
+
+    int status = STOP_HALT;
+    if (bench_count)
+    {
+        bench(vm, bench_count);
+    }
+    else
+    {
+        if (profile)
+        {
+            vm->profile = profile_create(vm->reg[R_PC]);
+            if (!vm->profile)
+            {
+                printf("out of memory\n");
+                exit(1);
+            }
+            profile_vm = vm;
+            profile_path = profile;
+            interrupt_hook = profile_dump;
+        }
+        if (trace)
+        {
+            vm->trace = trace_create(trace_entries);
+            if (!vm->trace)
+            {
+                printf("out of memory\n");
+                exit(1);
+            }
+            trace_vm = vm;
+            trace_path = trace;
+            interrupt_hook = trace_save;
+            signal(SIGABRT, trace_abort);
+        }
+
+        int debugged = gdb ? gdb_serve(vm, gdb) : GDB_DETACHED;
+        if (debugged == GDB_FAILED)
+        {
+            printf("failed to wait for the debugger on: %s\n", gdb);
+            status = STOP_ERROR;
+        }
+        else if (batch || max_instructions || timeout > 0)
+        {
+            status = batch_run(vm, engine, max_instructions, timeout);
+        }
+        else if (debugged == GDB_DETACHED && vm->running)
+        {
+            /* in slices too, so timed devices and interrupts happen on time; detached, without the debugger */
+            uint64_t executed;
+            status = run_saving(vm, gdb ? engine_select(jit ? ENGINE_JIT : 0) : engine, 0, UINT64_MAX, &executed);
+        }
+        sync_cond(vm);
+        console_flush(vm->console);
+
+        if (batch || max_instructions || timeout > 0)
+        {
+            batch_report(status);
+        }
+        if (profile)
+        {
+            profile_dump();
+        }
+        if (trace)
+        {
+            trace_save();
+        }
+    }
+    console_flush(vm->console);
+    if (vm->display)
+    {
+        display_end(vm);
+    }
+    if (checkpoint && !bench_count
+        && !(checkpoint_cache ? checkpoint_save_cached(vm, checkpoint, checkpoint_cache) : checkpoint_save(vm, checkpoint)))
+    {
+        fprintf(stderr, "failed to save checkpoint: %s\n", checkpoint);
+        status = STOP_ERROR;
+    }
+    if (recording && !record_close(recording))
+    {
+        fprintf(stderr, "failed to write the recording: %s\n", record);
+        status = STOP_ERROR;
+    }
+    restore_input_buffering();
+    return status;
+}
+
+#endif
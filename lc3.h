@@ -0,0 +1,89 @@
+#ifndef LC3_H
+#define LC3_H
+
+/*
+ * The VM as a library, built from the same source as the command line:
+ *
+ *     gcc -O2 -fPIC -shared -fvisibility=hidden -pthread -DLC3_LIBRARY -o liblc3.so lc3.c
+ *
+ * Each struct lc3 is a machine of its own, and runs on whatever thread
+ * calls lc3_run() for as many instructions as it is given. It never blocks
+ * that thread: a guest that wants a key that has not come stops with
+ * LC3_INPUT, and the next lc3_run() carries on where it left off. Machines
+ * share nothing, so different threads may run different ones.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LC3_API __attribute__((visibility("default")))
+#else
+#define LC3_API
+#endif
+
+struct lc3;
+
+/* why lc3_run() returned */
+enum lc3_stop
+{
+    LC3_HALT,      /* the guest halted, running it again does nothing */
+    LC3_BUDGET,    /* it ran all the instructions it was given */
+    LC3_INPUT,     /* it is waiting for a key */
+    LC3_TRAP,      /* it ran a TRAP passed to lc3_stop_at_trap(), see lc3_trap() */
+    LC3_FAULT      /* it ran a reserved opcode, or an RTI in user mode with nothing to handle it */
+};
+
+enum lc3_traps
+{
+    LC3_TRAPS_NATIVE,  /* GETC, OUT, PUTS, IN, PUTSP and HALT in C, the default */
+    LC3_TRAPS_GUEST,   /* every TRAP runs the guest's routine */
+    LC3_TRAPS_AUTO     /* native unless the images brought their own trap table */
+};
+
+#define LC3_NO_KEY (-1)  /* from read: no key yet */
+#define LC3_EOF (-2)     /* from read: the input is over */
+
+/* the guest's console, every field may be NULL */
+struct lc3_io
+{
+    /* output, a line or a buffer's worth at a time */
+    void (*write)(void* user, const char* text, size_t size);
+    /* the next key (0-255), LC3_NO_KEY or LC3_EOF; asked for at the start of lc3_run() */
+    int (*read)(void* user);
+    void* user;
+};
+
+/* a machine at power-on with PC x3000, NULL if out of memory */
+LC3_API struct lc3* lc3_create(const struct lc3_io* io);
+LC3_API void lc3_destroy(struct lc3* vm);
+
+/* load an image, a .obj or a cached one, from `size` bytes; returns 0 if it is not one */
+LC3_API int lc3_load_image(struct lc3* vm, const void* data, size_t size);
+/* once the images are loaded */
+LC3_API void lc3_set_traps(struct lc3* vm, enum lc3_traps mode);
+/* translate hot code to native code from now on, returns 0 if the JIT is not built in */
+LC3_API int lc3_use_jit(struct lc3* vm);
+
+/* run at most `max_instructions`, 0 for no limit */
+LC3_API enum lc3_stop lc3_run(struct lc3* vm, uint64_t max_instructions);
+/* instructions run by the last lc3_run() */
+LC3_API uint64_t lc3_executed(const struct lc3* vm);
+
+/* give the guest keys without a read callback, returns 0 if there is no room */
+LC3_API int lc3_push_key(struct lc3* vm, uint16_t key);
+LC3_API void lc3_end_input(struct lc3* vm);
+
+/* TRAP `vector` stops the run with LC3_TRAP, R7 and PC already past it, or again runs as it would */
+LC3_API void lc3_stop_at_trap(struct lc3* vm, uint8_t vector, int on);
+LC3_API uint8_t lc3_trap(const struct lc3* vm);
+
+/* R0-R7 are 0-7, then LC3_PC and LC3_PSR */
+#define LC3_PC 8
+#define LC3_PSR 9
+LC3_API uint16_t lc3_reg(const struct lc3* vm, int r);
+LC3_API void lc3_set_reg(struct lc3* vm, int r, uint16_t value);
+/* memory as the guest sees it, device registers included */
+LC3_API uint16_t lc3_read(struct lc3* vm, uint16_t address);
+LC3_API void lc3_write(struct lc3* vm, uint16_t address, uint16_t value);
+
+#endif
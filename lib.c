@@ -0,0 +1,183 @@
+/*
+ * The lc3.h API, built with -DLC3_LIBRARY in place of main(). A handle is
+ * a VM with a keyboard and a console of its own; lc3_run() is
+ * run_limited(), so the interpreter keeps its state to itself for a whole
+ * slice and only the slice boundaries cost anything extra.
+ */
+#include "lc3.h"
+
+struct lc3
+{
+    struct vm* vm;
+    run_fn engine;
+    struct lc3_io io;
+    struct kbd_fifo kbd;
+    uint16_t keys[KBD_FIFO_SIZE];
+    struct console console;
+    uint64_t executed;             /* by the last lc3_run() */
+    int traps;                     /* TRAPS_* */
+    uint8_t stop_traps[256];       /* vectors that end the run */
+};
+
+/* the native routine of a vector passed to lc3_stop_at_trap() */
+void lib_trap(struct vm* vm, uint16_t vector)
+{
+    vm->stopped = STOP_TRAP;
+    vm->trap_vector = vector;
+    vm->yield = 1;
+}
+
+/* the device table is shared by every VM, the first lc3_create() fills it in and the others wait for it */
+atomic_int lib_devices; /* 0 at first, 1 while it is being filled in, then 2 */
+
+LC3_API struct lc3* lc3_create(const struct lc3_io* io)
+{
+    int state = 0;
+    if (atomic_compare_exchange_strong(&lib_devices, &state, 1))
+    {
+        devices_init();
+        atomic_store(&lib_devices, 2);
+    }
+    while (atomic_load(&lib_devices) != 2);
+
+    struct lc3* h = calloc(1, sizeof(*h));
+    if (!h) return NULL;
+    if (io) h->io = *io;
+    kbd_init_empty(&h->kbd, h->keys, KBD_FIFO_SIZE);
+    h->console.write = h->io.write;
+    h->console.user = h->io.user;
+    h->vm = vm_create(&h->kbd, &h->console);
+    if (!h->vm)
+    {
+        free(h);
+        return NULL;
+    }
+    h->vm->embedder = h;
+    h->engine = engine_select(0);
+    h->traps = TRAPS_NATIVE;
+    return h;
+}
+
+LC3_API void lc3_destroy(struct lc3* h)
+{
+    if (!h) return;
+    vm_destroy(h->vm);
+    free(h);
+}
+
+LC3_API int lc3_load_image(struct lc3* h, const void* data, size_t size)
+{
+    if (load_image(h->vm, (const uint8_t*)data, size) != IMAGE_OK) return 0;
+#if LC3_JIT
+    /* the image is copied in without the store hooks, code translated from what it replaced goes at the next block */
+    if (h->vm->jit) h->vm->jit_stale = 1;
+#endif
+    return 1;
+}
+
+/* set_traps() for `traps`, then the vectors that stop */
+void lib_traps(struct lc3* h)
+{
+    set_traps(h->vm, h->traps);
+    for (int v = 0; v < 256; ++v)
+    {
+        if (h->stop_traps[v]) h->vm->traps[v] = lib_trap;
+    }
+}
+
+LC3_API void lc3_set_traps(struct lc3* h, enum lc3_traps mode)
+{
+    h->traps = mode == LC3_TRAPS_GUEST ? TRAPS_GUEST : mode == LC3_TRAPS_AUTO ? TRAPS_AUTO : TRAPS_NATIVE;
+    lib_traps(h);
+}
+
+LC3_API int lc3_use_jit(struct lc3* h)
+{
+#if LC3_JIT
+    if (!h->vm->jit && !jit_init(h->vm)) return 0;
+    h->engine = engine_select(ENGINE_JIT);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+LC3_API enum lc3_stop lc3_run(struct lc3* h, uint64_t max_instructions)
+{
+    struct vm* vm = h->vm;
+    h->executed = 0;
+    if (!vm->running)
+    {
+        return LC3_HALT;
+    }
+
+    while (h->io.read && !kbd_full(&h->kbd) && !atomic_load(&h->kbd.closed))
+    {
+        int key = h->io.read(h->io.user);
+        if (key == LC3_NO_KEY) break;
+        if (key == LC3_EOF) lc3_end_input(h);
+        else kbd_push(&h->kbd, (uint16_t)key);
+    }
+
+    vm->stopped = 0;
+    int status = run_limited(vm, h->engine, max_instructions, UINT64_MAX, &h->executed);
+    console_flush(vm->console);
+    switch (status)
+    {
+        case STOP_HALT: return LC3_HALT;
+        case STOP_INPUT: return LC3_INPUT;
+        case STOP_TRAP: return LC3_TRAP;
+        case STOP_FAULT: return LC3_FAULT;
+        default: return LC3_BUDGET;
+    }
+}
+
+LC3_API uint64_t lc3_executed(const struct lc3* h)
+{
+    return h->executed;
+}
+
+LC3_API int lc3_push_key(struct lc3* h, uint16_t key)
+{
+    if (kbd_full(&h->kbd) || atomic_load(&h->kbd.closed)) return 0;
+    kbd_push(&h->kbd, key);
+    return 1;
+}
+
+LC3_API void lc3_end_input(struct lc3* h)
+{
+    atomic_store(&h->kbd.closed, 1);
+}
+
+LC3_API void lc3_stop_at_trap(struct lc3* h, uint8_t vector, int on)
+{
+    h->stop_traps[vector] = on != 0;
+    lib_traps(h);
+}
+
+LC3_API uint8_t lc3_trap(const struct lc3* h)
+{
+    return (uint8_t)h->vm->trap_vector;
+}
+
+LC3_API uint16_t lc3_reg(const struct lc3* h, int r)
+{
+    if (r == LC3_PSR) return psr_read(h->vm, MR_PSR);
+    return r >= 0 && r <= LC3_PC ? h->vm->reg[r == LC3_PC ? R_PC : R_R0 + r] : 0;
+}
+
+LC3_API void lc3_set_reg(struct lc3* h, int r, uint16_t value)
+{
+    if (r == LC3_PSR) psr_write(h->vm, MR_PSR, value);
+    else if (r >= 0 && r <= LC3_PC) h->vm->reg[r == LC3_PC ? R_PC : R_R0 + r] = value;
+}
+
+LC3_API uint16_t lc3_read(struct lc3* h, uint16_t address)
+{
+    return mem_read(h->vm, address);
+}
+
+LC3_API void lc3_write(struct lc3* h, uint16_t address, uint16_t value)
+{
+    mem_write(h->vm, address, value);
+}
@@ -0,0 +1,172 @@
+/*
+ * Loading several images at once. Every header is read before any word is
+ * copied, which gives the range each image covers: images that overlap are
+ * reported, since the later one silently replaces part of the earlier, and
+ * the pages they cover are marked populated in one go. Images that overlap
+ * nothing can be copied in any order, so with enough words to be worth it
+ * they are split between threads; the rest follow one at a time in the
+ * order given. Source (.asm) images have no header, so a list with one is
+ * simply loaded in order.
+ */
+#define LOAD_PARALLEL_MIN (32 * 1024) /* words, below this a thread costs more than the copy */
+#define LOAD_THREADS_MAX 8
+
+struct load_item
+{
+    const uint8_t* data;
+    size_t size;
+    struct image_header header;
+    int overlaps;      /* shares words with another image */
+};
+
+struct load_worker
+{
+    struct thread thread;
+    struct vm* vm;
+    struct load_item* items;
+    int count;
+    int first;         /* this worker takes every `step`th image from `first` */
+    int step;
+};
+
+void load_thread(void* arg)
+{
+    struct load_worker* w = arg;
+    for (int i = w->first; i < w->count; i += w->step)
+    {
+        if (!w->items[i].overlaps)
+        {
+            image_place(w->vm, w->items[i].data, &w->items[i].header);
+        }
+    }
+}
+
+/* copy the images that overlap nothing, on threads if there are enough words */
+void load_independent(struct vm* vm, struct load_item* items, int count, int parallel)
+{
+    size_t words = 0;
+    int independent = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        if (!items[i].overlaps)
+        {
+            words += items[i].header.count;
+            ++independent;
+        }
+    }
+
+    struct load_worker workers[LOAD_THREADS_MAX];
+    int threads = 0;
+    if (parallel && independent > 1 && words >= LOAD_PARALLEL_MIN)
+    {
+        threads = cpu_count();
+        if (threads > LOAD_THREADS_MAX) threads = LOAD_THREADS_MAX;
+        if (threads > independent) threads = independent;
+    }
+
+    /* worker 0 is the calling thread, it also takes the share of any that fails to start */
+    int started[LOAD_THREADS_MAX] = { 0 };
+    for (int t = 0; t < threads; ++t)
+    {
+        workers[t] = (struct load_worker){ .vm = vm, .items = items, .count = count, .first = t, .step = threads };
+        started[t] = t > 0 && thread_start(&workers[t].thread, load_thread, &workers[t]);
+    }
+    if (!threads)
+    {
+        workers[0] = (struct load_worker){ .vm = vm, .items = items, .count = count, .first = 0, .step = 1 };
+        threads = 1;
+    }
+    for (int t = 0; t < threads; ++t)
+    {
+        if (!started[t]) load_thread(&workers[t]);
+    }
+    for (int t = 1; t < threads; ++t)
+    {
+        if (started[t]) thread_join(&workers[t].thread);
+    }
+}
+
+/*
+ * Load `paths` in order, a later image winning where two overlap. Returns
+ * IMAGE_* of the first failure and its index in `failed`, in which case
+ * nothing has been copied yet unless the list holds source images.
+ */
+int load_images(struct vm* vm, const char* const* paths, int count, int parallel, int* failed)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        if (is_asm(paths[i]))
+        {
+            for (*failed = 0; *failed < count; ++*failed)
+            {
+                int result = read_image(vm, paths[*failed]);
+                if (result != IMAGE_OK) return result;
+            }
+            return IMAGE_OK;
+        }
+    }
+
+    struct load_item* items = calloc(count > 0 ? (size_t)count : 1, sizeof(*items));
+    if (!items)
+    {
+        *failed = 0;
+        return IMAGE_UNREADABLE;
+    }
+
+    int result = IMAGE_OK;
+    int mapped = 0;
+    for (; mapped < count; ++mapped)
+    {
+        struct load_item* it = &items[mapped];
+        it->data = map_file(paths[mapped], &it->size);
+        result = it->data ? image_scan(it->data, it->size, &it->header) : IMAGE_UNREADABLE;
+        if (result != IMAGE_OK)
+        {
+            *failed = mapped;
+            if (it->data) ++mapped;
+            break;
+        }
+    }
+
+    if (result == IMAGE_OK)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            const struct image_header* a = &items[i].header;
+            for (int j = i + 1; j < count; ++j)
+            {
+                const struct image_header* b = &items[j].header;
+                size_t lo = a->origin > b->origin ? a->origin : b->origin;
+                size_t hi = a->origin + a->count < b->origin + b->count ? a->origin + a->count : b->origin + b->count;
+                if (lo < hi)
+                {
+                    fprintf(stderr, "%s replaces %s at x%04X-x%04X\n",
+                            paths[j], paths[i], (unsigned)lo, (unsigned)(hi - 1));
+                    items[i].overlaps = items[j].overlaps = 1;
+                }
+            }
+        }
+
+        load_independent(vm, items, count, parallel);
+        for (int i = 0; i < count; ++i)
+        {
+            if (items[i].overlaps)
+            {
+                image_place(vm, items[i].data, &items[i].header);
+            }
+        }
+        for (int i = 0; i < count; ++i)
+        {
+            const struct image_header* h = &items[i].header;
+            pages_mark(vm, h->origin, h->count);
+            vm->decoded[(uint16_t)(h->origin - 1)].flags = 0; /* may have fused with the first word */
+        }
+    }
+
+    for (int i = 0; i < mapped; ++i)
+    {
+        unmap_file(items[i].data, items[i].size);
+    }
+    free(items);
+    return result;
+}
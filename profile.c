@@ -0,0 +1,192 @@
+/*
+ * Execution profile, collected by the run_profile interpreter. Instructions
+ * are counted per opcode, per trap vector and per PC in flat arrays, and per
+ * subroutine in a call tree that follows JSR/JSRR and RET (JMP R7). The tree
+ * comes out as folded stacks for flame graph tools.
+ */
+#define PROFILE_NODES_MAX (1 << 16)
+#define PROFILE_TOP 20 /* PCs in the hot-spot report */
+
+struct profile_node
+{
+    uint16_t address;   /* entry point of the subroutine */
+    uint32_t parent;
+    uint32_t child;     /* first callee, 0 for none */
+    uint32_t sibling;
+    uint64_t count;     /* instructions in it, not counting its callees */
+};
+
+struct profile
+{
+    uint64_t instructions;
+    uint64_t ops[OP_COUNT];
+    uint64_t traps[256];
+    uint64_t pcs[MEMORY_MAX];
+    uint8_t pc_ops[MEMORY_MAX]; /* the opcode last run at each PC */
+    struct profile_node* nodes; /* nodes[0] is where the program started */
+    uint32_t node_count;
+    uint32_t current;
+};
+
+const char* op_names[OP_COUNT] =
+{
+    "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+    "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP",
+    "LD (device)", "ST (device)"
+};
+
+const char* trap_names[] = { "GETC", "OUT", "PUTS", "IN", "PUTSP", "HALT" };
+
+struct profile* profile_create(uint16_t start)
+{
+    struct profile* p = calloc(1, sizeof(*p));
+    if (!p) return NULL;
+    p->nodes = calloc(PROFILE_NODES_MAX, sizeof(*p->nodes));
+    if (!p->nodes)
+    {
+        free(p);
+        return NULL;
+    }
+    p->nodes[0].address = start;
+    p->node_count = 1;
+    return p;
+}
+
+/* descend into the callee at `address`, or stay put once the tree is full */
+void profile_call(struct profile* p, uint16_t address)
+{
+    struct profile_node* node = &p->nodes[p->current];
+    uint32_t i = node->child;
+    while (i && p->nodes[i].address != address)
+    {
+        i = p->nodes[i].sibling;
+    }
+    if (!i)
+    {
+        if (p->node_count == PROFILE_NODES_MAX) return;
+        i = p->node_count++;
+        p->nodes[i].address = address;
+        p->nodes[i].parent = p->current;
+        p->nodes[i].sibling = node->child;
+        node->child = i;
+    }
+    p->current = i;
+}
+
+/* count the instruction `d` at `pc`, before it runs; it always runs alone here */
+static inline void profile_step(struct vm* vm, uint16_t pc, struct decoded* d)
+{
+    struct profile* p = vm->profile;
+    ++p->instructions;
+    ++p->ops[d->base];
+    ++p->pcs[pc];
+    p->pc_ops[pc] = d->base;
+    ++p->nodes[p->current].count;
+
+    if (d->base == OP_TRAP)
+    {
+        ++p->traps[d->imm];
+        /* a guest routine returns with RET like a subroutine */
+        if (vm->traps[d->imm] == trap_guest && vm->memory[d->imm])
+        {
+            profile_call(p, vm->memory[d->imm]);
+        }
+    }
+    else if (d->base == OP_JSR)
+    {
+        /* the same order as the handler, JSRR R7 lands on the return address */
+        uint16_t ret = pc + 1;
+        profile_call(p, d->flags & DEC_IMM ? (uint16_t)(ret + d->imm) : d->r1 == R_R7 ? ret : vm->reg[d->r1]);
+    }
+    else if (d->base == OP_JMP && d->r1 == R_R7 && p->current)
+    {
+        p->current = p->nodes[p->current].parent;
+    }
+}
+
+int profile_compare(const void* a, const void* b)
+{
+    uint64_t x = **(const uint64_t* const*)a, y = **(const uint64_t* const*)b;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* the hot-spot report on `out` */
+void profile_report(struct profile* p, FILE* out)
+{
+    double total = p->instructions ? (double)p->instructions : 1;
+    fprintf(out, "profile: %llu instructions\n\n%-12s %14s %7s\n", (unsigned long long)p->instructions,
+            "opcode", "count", "%");
+    for (int op = 0; op < OP_COUNT; ++op)
+    {
+        if (p->ops[op])
+        {
+            fprintf(out, "%-12s %14llu %6.2f%%\n", op_names[op], (unsigned long long)p->ops[op], p->ops[op] * 100 / total);
+        }
+    }
+
+    fprintf(out, "\n%-12s %14s\n", "trap", "count");
+    for (int t = 0; t < 256; ++t)
+    {
+        if (p->traps[t])
+        {
+            fprintf(out, "x%02X %-8s %14llu\n", t, t >= TRAP_GETC && t <= TRAP_HALT ? trap_names[t - TRAP_GETC] : "",
+                    (unsigned long long)p->traps[t]);
+        }
+    }
+
+    /* sort pointers to the non-zero counters, the index is the PC */
+    static const uint64_t* hot[MEMORY_MAX];
+    size_t n = 0;
+    for (size_t pc = 0; pc < MEMORY_MAX; ++pc)
+    {
+        if (p->pcs[pc]) hot[n++] = &p->pcs[pc];
+    }
+    qsort(hot, n, sizeof(hot[0]), profile_compare);
+
+    fprintf(out, "\n%-12s %14s %7s  %s\n", "pc", "count", "%", "opcode");
+    for (size_t i = 0; i < n && i < PROFILE_TOP; ++i)
+    {
+        size_t pc = (size_t)(hot[i] - p->pcs);
+        fprintf(out, "x%04X%7s %14llu %6.2f%%  %s\n", (unsigned)pc, "", (unsigned long long)*hot[i], *hot[i] * 100 / total,
+                op_names[p->pc_ops[pc]]);
+    }
+}
+
+/* one line per call path: the subroutine addresses from the root, then a count */
+int profile_write_folded(struct profile* p, const char* path)
+{
+    FILE* out = fopen(path, "w");
+    if (!out) return 0;
+
+    static uint32_t stack[PROFILE_NODES_MAX];
+    for (uint32_t i = 0; i < p->node_count; ++i)
+    {
+        if (!p->nodes[i].count) continue;
+
+        uint32_t depth = 0;
+        for (uint32_t n = i; ; n = p->nodes[n].parent)
+        {
+            stack[depth++] = n;
+            if (n == 0) break;
+        }
+        while (depth--)
+        {
+            fprintf(out, "x%04X%s", p->nodes[stack[depth]].address, depth ? ";" : "");
+        }
+        fprintf(out, " %llu\n", (unsigned long long)p->nodes[i].count);
+    }
+    return fclose(out) == 0;
+}
+
+struct vm* profile_vm;
+const char* profile_path;
+
+/* the report on stderr and the folded stacks in profile_path */
+void profile_dump()
+{
+    profile_report(profile_vm->profile, stderr);
+    if (!profile_write_folded(profile_vm->profile, profile_path))
+    {
+        fprintf(stderr, "failed to write profile: %s\n", profile_path);
+    }
+}
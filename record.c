@@ -0,0 +1,94 @@
+/*
+ * Recording a session for --input-script to replay. The terminal's keys do
+ * not go to the guest when they arrive but between slices, where the clock
+ * is exact, each written down with the instruction count it was handed over
+ * at. A replay hands it over at the same count, so the guest reads every
+ * key at the same instruction it did while recorded, without a terminal
+ * and as fast as it can run. Slices are kept short so keys still arrive
+ * about when they are typed.
+ */
+#define RECORD_SLICE (1 << 16)
+
+struct record
+{
+    FILE* out;
+    struct kbd_fifo* source;  /* the terminal's keys */
+    struct kbd_fifo kbd;      /* what the guest reads */
+    uint16_t keys[KBD_FIFO_SIZE];
+    uint64_t last;            /* the instruction count of the last entry */
+    int ended;                /* end of file is in the log */
+};
+
+void record_varint(FILE* out, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        fputc((int)(v & 0x7F) | 0x80, out);
+        v >>= 7;
+    }
+    fputc((int)v, out);
+}
+
+/* start recording the keys from `source` to `path`, NULL if it cannot be written */
+struct record* record_create(const char* path, struct kbd_fifo* source)
+{
+    struct record* r = calloc(1, sizeof(*r));
+    if (!r) return NULL;
+    r->out = fopen(path, "wb");
+    if (!r->out || fwrite(RECORD_MAGIC, 4, 1, r->out) != 1)
+    {
+        if (r->out) fclose(r->out);
+        free(r);
+        return NULL;
+    }
+    r->source = source;
+    kbd_init_empty(&r->kbd, r->keys, KBD_FIFO_SIZE);
+    return r;
+}
+
+/* between slices: hand the keys that came in to the guest and log them */
+void record_poll(struct vm* vm)
+{
+    struct record* r = vm->record;
+    if (r->ended) return;
+    /* a guest polling for a key that has not come would only spin */
+    if (vm->kbd_empty_polls >= KBD_SPIN_POLLS)
+    {
+        input_wait(r->source, KBD_SPIN_WAIT_MS);
+    }
+
+    int logged = 0;
+    while (!kbd_full(&r->kbd))
+    {
+        /* the source closes after its last key, so closed and empty is the end */
+        int closed = atomic_load(&r->source->closed);
+        uint16_t c;
+        if (!kbd_peek(r->source, &c, 1))
+        {
+            if (closed)
+            {
+                record_varint(r->out, (vm->instructions - r->last) << 1 | RECORD_EOF);
+                atomic_store(&r->kbd.closed, 1);
+                r->ended = logged = 1;
+            }
+            break;
+        }
+        kbd_pop(r->source, &c);
+        record_varint(r->out, (vm->instructions - r->last) << 1);
+        record_varint(r->out, c);
+        kbd_push(&r->kbd, c);
+        r->last = vm->instructions;
+        logged = 1;
+    }
+    /* keys are few, so the log is kept whole in case the run is killed */
+    if (logged) fflush(r->out);
+}
+
+/* returns 0 if the log could not be written */
+int record_close(struct record* r)
+{
+    int ok = !ferror(r->out);
+    ok = fclose(r->out) == 0 && ok;
+    free(r);
+    return ok;
+}
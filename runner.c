@@ -0,0 +1,273 @@
+/*
+ * --parallel runs every image on the command line as its own job, each on a
+ * VM of its own, on a pool of worker threads. Every worker owns one VM and
+ * resets it between jobs. The jobs are dealt out evenly up front; a worker
+ * that runs out steals half of what another one has left.
+ *
+ * With a snapshot (--snapshot or --preload) every job starts from a
+ * copy-on-write view of it, so shared images are neither read nor cleared
+ * per job.
+ *
+ * A job gets the --input file as its keyboard (or nothing, so reads see end
+ * of file) or replays the --input-script, writes its output to `<last image>.out` and reports a JSON line
+ * on stderr once all jobs are done.
+ */
+
+struct job
+{
+    const char* images;     /* comma separated, loaded in order */
+    int status;             /* STOP_* */
+    uint64_t instructions;
+    double seconds;
+    uint16_t pc;
+};
+
+struct worker
+{
+    /* jobs left to run: the next one in the low 32 bits, the end in the high */
+    _Atomic uint64_t range;
+    int index;
+    struct vm* vm;
+    struct kbd_fifo kbd;
+    uint16_t* script_keys;  /* room for every key of the script */
+    struct console console;
+    struct thread thread;
+};
+
+struct job* runner_jobs;
+struct worker* runner_workers;
+int runner_worker_count;
+run_fn runner_engine;
+int runner_traps;       /* TRAPS_* */
+uint64_t runner_max_instructions;
+double runner_timeout;
+struct snapshot* runner_base; /* what every job starts from, or NULL */
+uint16_t* runner_keys;  /* the --input file, shared by every job */
+unsigned runner_key_count;
+struct script* runner_script; /* the --input-script, or NULL */
+
+uint64_t range_pack(uint32_t next, uint32_t end)
+{
+    return (uint64_t)end << 32 | next;
+}
+
+/* the next job for `w`, its own first and then stolen from the others */
+int runner_take(struct worker* w, uint32_t* job)
+{
+    uint64_t r = atomic_load(&w->range);
+    for (;;)
+    {
+        uint32_t next = (uint32_t)r, end = (uint32_t)(r >> 32);
+        if (next >= end) break;
+        if (atomic_compare_exchange_weak(&w->range, &r, range_pack(next + 1, end)))
+        {
+            *job = next;
+            return 1;
+        }
+    }
+
+    for (int i = 1; i < runner_worker_count; ++i)
+    {
+        struct worker* victim = &runner_workers[(w->index + i) % runner_worker_count];
+        r = atomic_load(&victim->range);
+        for (;;)
+        {
+            uint32_t next = (uint32_t)r, end = (uint32_t)(r >> 32);
+            if (next >= end) break;
+
+            /* take the back half, the owner keeps working from the front */
+            uint32_t half = (end - next + 1) / 2;
+            if (atomic_compare_exchange_weak(&victim->range, &r, range_pack(next, end - half)))
+            {
+                /* our range is empty, so nobody else touches it meanwhile */
+                atomic_store(&w->range, range_pack(end - half + 1, end));
+                *job = end - half;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void runner_run(struct worker* w, struct job* job)
+{
+    struct vm* vm = w->vm;
+    kbd_init_keys(&w->kbd, runner_keys, runner_key_count);
+
+    job->status = STOP_ERROR;
+    if (runner_base)
+    {
+        if (!vm_restore(vm, runner_base))
+        {
+            return;
+        }
+    }
+    else
+    {
+        vm_reset(vm);
+    }
+    if (read_images(vm, job->images, 0) != IMAGE_OK)
+    {
+        return;
+    }
+    set_traps(vm, runner_traps);
+    if (!cfg_prepare(vm))
+    {
+        return;
+    }
+    if (runner_script)
+    {
+        script_start(vm, runner_script, w->script_keys);
+    }
+
+    const char* last = strrchr(job->images, ',');
+    last = last ? last + 1 : job->images;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.out", last);
+    FILE* out = fopen(path, "wb");
+    if (!out)
+    {
+        return;
+    }
+    w->console.out = out;
+
+    uint64_t start = clock_ns();
+    uint64_t deadline = runner_timeout > 0 ? start + (uint64_t)(runner_timeout * 1e9) : UINT64_MAX;
+    job->status = run_limited(vm, runner_engine, runner_max_instructions, deadline, &job->instructions);
+    job->seconds = (clock_ns() - start) / 1e9;
+    job->pc = vm->reg[R_PC];
+
+    console_flush(&w->console);
+    fclose(out);
+}
+
+void runner_thread(void* arg)
+{
+    struct worker* w = arg;
+    uint32_t job;
+    while (runner_take(w, &job))
+    {
+        runner_run(w, &runner_jobs[job]);
+    }
+}
+
+/* read all of `path` as keys, one per byte */
+int runner_read_keys(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+
+    size_t cap = 4096, n = 0;
+    uint16_t* keys = malloc(cap * sizeof(*keys));
+    int c;
+    while (keys && (c = fgetc(file)) != EOF)
+    {
+        if (n == cap)
+        {
+            cap *= 2;
+            keys = realloc(keys, cap * sizeof(*keys));
+            if (!keys) break;
+        }
+        keys[n++] = (uint16_t)c;
+    }
+    fclose(file);
+
+    runner_keys = keys;
+    runner_key_count = (unsigned)n;
+    return keys != NULL;
+}
+
+/* run `count` jobs on `workers` threads, the exit status is the worst job's */
+int runner_main(int workers, const char** images, int count, struct snapshot* base,
+                const char* input, const char* input_script, int jit, int traps,
+                uint64_t max_instructions, double timeout)
+{
+    if (input && !runner_read_keys(input))
+    {
+        printf("failed to open input: %s\n", input);
+        exit(1);
+    }
+    if (input_script && !(runner_script = script_read(input_script)))
+    {
+        printf("failed to read input script: %s\n", input_script);
+        exit(1);
+    }
+    if (workers > count)
+    {
+        workers = count;
+    }
+
+    runner_base = base;
+    runner_engine = engine_select(jit ? ENGINE_JIT : 0);
+    runner_traps = traps;
+    runner_max_instructions = max_instructions;
+    runner_timeout = timeout;
+    runner_jobs = calloc(count, sizeof(*runner_jobs));
+    runner_workers = calloc(workers, sizeof(*runner_workers));
+    runner_worker_count = workers;
+    if (!runner_jobs || !runner_workers)
+    {
+        printf("out of memory\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        runner_jobs[i].images = images[i];
+    }
+
+    for (int i = 0; i < workers; ++i)
+    {
+        struct worker* w = &runner_workers[i];
+        w->index = i;
+        atomic_init(&w->range, range_pack((uint32_t)((uint64_t)count * i / workers),
+                                          (uint32_t)((uint64_t)count * (i + 1) / workers)));
+        w->console.fully_buffered = 1;
+        w->vm = vm_create(&w->kbd, &w->console);
+        if (runner_script)
+        {
+            w->script_keys = malloc((runner_script->count ? runner_script->count : 1) * sizeof(uint16_t));
+        }
+        if (!w->vm || (runner_script && !w->script_keys))
+        {
+            printf("out of memory\n");
+            exit(1);
+        }
+#if LC3_JIT
+        if (jit && !jit_init(w->vm))
+        {
+            printf("failed to set up the JIT\n");
+            exit(1);
+        }
+#endif
+    }
+
+    for (int i = 0; i < workers; ++i)
+    {
+        if (!thread_start(&runner_workers[i].thread, runner_thread, &runner_workers[i]))
+        {
+            printf("failed to start worker %d\n", i);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < workers; ++i)
+    {
+        thread_join(&runner_workers[i].thread);
+        vm_destroy(runner_workers[i].vm);
+        free(runner_workers[i].script_keys);
+    }
+
+    int status = STOP_HALT;
+    for (int i = 0; i < count; ++i)
+    {
+        struct job* job = &runner_jobs[i];
+        fprintf(stderr, "{\"image\": \"%s\", \"status\": \"%s\", \"instructions\": %llu, \"seconds\": %.6f, \"pc\": %u}\n",
+                job->images, stop_names[job->status], (unsigned long long)job->instructions,
+                job->seconds, job->pc);
+        if (job->status > status)
+        {
+            status = job->status;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,225 @@
+/*
+ * Input scripts replay keys at set points on the instruction clock, so a
+ * run reads the same keys at the same instructions on every host and its
+ * output does not depend on how fast it ran. Each line is an instruction
+ * count and, after one space, the keys that arrive once that many
+ * instructions have run:
+ *
+ *     0 run\n
+ *     250000 q
+ *
+ * \n, \t, \\ and \xHH stand for themselves, lines starting with # and empty
+ * lines are skipped and the counts may not go down. Once the last keys are
+ * in the keyboard reaches end of file.
+ *
+ * A session saved with --record, see record.c, is read the same way and
+ * also says when end of file came.
+ */
+struct script
+{
+    uint64_t* when;    /* per key */
+    uint16_t* keys;
+    unsigned count;
+    uint64_t closes;   /* when the keyboard reaches end of file, at the last key or later */
+};
+
+void script_free(struct script* s)
+{
+    free(s->when);
+    free(s->keys);
+    free(s);
+}
+
+/* the text format above into `s`, which has room for a key a byte */
+int script_parse(struct script* s, const uint8_t* data, size_t size)
+{
+    int ok = 1;
+    const char* p = (const char*)data;
+    const char* end = p + size;
+    uint64_t last = 0;
+    while (ok && p < end)
+    {
+        const char* eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) eol = end;
+        if (p == eol || *p == '#' || (*p == '\r' && p + 1 == eol))
+        {
+            p = eol + 1;
+            continue;
+        }
+
+        uint64_t when = 0;
+        const char* q = p;
+        while (q < eol && *q >= '0' && *q <= '9')
+        {
+            when = when * 10 + (uint64_t)(*q++ - '0');
+        }
+        if (q == p || (q < eol && *q != ' ' && *q != '\r') || when < last)
+        {
+            ok = 0;
+            break;
+        }
+        last = when;
+        if (q < eol && *q == ' ') ++q;
+        if (eol > q && eol[-1] == '\r') --eol;
+
+        while (q < eol)
+        {
+            uint16_t c = (uint8_t)*q++;
+            if (c == '\\' && q < eol)
+            {
+                char e = *q++;
+                if (e == 'n') c = '\n';
+                else if (e == 't') c = '\t';
+                else if (e == '\\') c = '\\';
+                else if (e == 'x' && eol - q >= 2 && hex_digit(q[0]) >= 0 && hex_digit(q[1]) >= 0)
+                {
+                    c = (uint16_t)(hex_digit(q[0]) << 4 | hex_digit(q[1]));
+                    q += 2;
+                }
+                else
+                {
+                    ok = 0;
+                    break;
+                }
+            }
+            s->when[s->count] = when;
+            s->keys[s->count++] = c;
+        }
+        p = (eol < end && *eol == '\r') ? eol + 2 : eol + 1;
+    }
+    s->closes = last;
+    return ok;
+}
+
+/*
+ * A recording is RECORD_MAGIC and then an entry per key: the instructions
+ * since the last entry shifted up a bit, with RECORD_EOF in the bit for
+ * the end of the input, then the key unless it is that. Both are LEB128,
+ * 7 bits a byte, low first, bit 7 set on all but the last.
+ */
+#define RECORD_MAGIC "LC3R"
+#define RECORD_EOF 1
+
+/* the varint at `*p` in `v`, returns 0 if it runs past `end` */
+int script_varint(const uint8_t** p, const uint8_t* end, uint64_t* v)
+{
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7)
+    {
+        uint8_t b = *(*p)++;
+        *v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return 1;
+    }
+    return 0;
+}
+
+/* a recording into `s` */
+int script_decode(struct script* s, const uint8_t* data, size_t size)
+{
+    const uint8_t* p = data + 4;
+    const uint8_t* end = data + size;
+    uint64_t when = 0;
+    while (p < end)
+    {
+        uint64_t delta, key;
+        if (!script_varint(&p, end, &delta)) return 0;
+        when += delta >> 1;
+        if (delta & RECORD_EOF)
+        {
+            s->closes = when;
+            return p == end;
+        }
+        if (!script_varint(&p, end, &key) || key > 0xFFFF) return 0;
+        s->when[s->count] = when;
+        s->keys[s->count++] = (uint16_t)key;
+    }
+    /* recorded until the guest stopped, it never saw end of file */
+    s->closes = when;
+    return 1;
+}
+
+/* the script at `path`, NULL if it cannot be read or is not one */
+struct script* script_read(const char* path)
+{
+    size_t size;
+    const uint8_t* data = map_file(path, &size);
+    if (!data)
+    {
+        return NULL;
+    }
+
+    /* no line holds more keys than characters, and a recorded key takes two bytes */
+    struct script* s = calloc(1, sizeof(*s));
+    if (s)
+    {
+        s->when = malloc((size ? size : 1) * sizeof(*s->when));
+        s->keys = malloc((size ? size : 1) * sizeof(*s->keys));
+    }
+    int ok = s && s->when && s->keys;
+    if (ok)
+    {
+        ok = size >= 4 && memcmp(data, RECORD_MAGIC, 4) == 0 ? script_decode(s, data, size)
+                                                              : script_parse(s, data, size);
+    }
+    unmap_file(data, size);
+
+    if (!ok)
+    {
+        if (s) script_free(s);
+        return NULL;
+    }
+    return s;
+}
+
+/* hand over the keys that are due, then wait for the next ones or end the input */
+void script_fire(struct vm* vm)
+{
+    const struct script* s = vm->script;
+    while (vm->script_next < s->count && s->when[vm->script_next] <= vm->instructions)
+    {
+        kbd_push(vm->kbd, s->keys[vm->script_next++]);
+    }
+    if (vm->script_next < s->count)
+    {
+        event_push(vm, s->when[vm->script_next], EVENT_KEY);
+    }
+    else if (s->closes > vm->instructions)
+    {
+        event_push(vm, s->closes, EVENT_KEY);
+    }
+    else
+    {
+        atomic_store(&vm->kbd->closed, 1);
+    }
+}
+
+/*
+ * Play `s` into the keyboard of `vm`, once it has been reset and loaded.
+ * `keys` has room for all of them, so the keyboard never fills up.
+ */
+void script_start(struct vm* vm, const struct script* s, uint16_t* keys)
+{
+    kbd_init_empty(vm->kbd, keys, s->count ? s->count : 1);
+    vm->script = s;
+    vm->script_next = 0;
+    event_cancel(vm, EVENT_KEY);
+    script_fire(vm);
+}
+
+/*
+ * A native GETC or IN that finds no key yet waits the way the guest's own
+ * routine would, on the clock: the TRAP runs again after the idle guest
+ * has skipped ahead to the next keys. Recorded keys also only come between
+ * slices, see record_poll(), and an embedded VM stops to wait for them.
+ */
+int script_wait(struct vm* vm)
+{
+    if ((!vm->script && !vm->record && !vm->embedder) || !kbd_empty(vm->kbd))
+    {
+        return 0;
+    }
+    vm->reg[R_PC] = vm->reg[R_R7] - 1;
+    vm->idle = 1;
+    vm->yield = 1;
+    return 1;
+}
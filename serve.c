@@ -0,0 +1,293 @@
+/*
+ * --serve=port starts a VM for every connection to a TCP port on localhost
+ * (or a Unix socket path) and runs all of them on one thread. What the
+ * client sends is typed into its VM, a byte a key, and what the guest
+ * prints is sent back; the connection closes once the guest halts.
+ *
+ * The VMs are embedded ones, see lib.c, so none of them ever blocks the
+ * thread: a guest waiting for a key that has not come ends its slice with
+ * STOP_INPUT and is put aside until its socket has something to read, then
+ * picks up again at the same instruction. Its registers and memory are the
+ * whole of its state, there is no stack to keep. VMs that can run take
+ * turns of SERVE_SLICE instructions, with a look at the sockets between
+ * rounds.
+ *
+ * Every VM is a copy-on-write view of one snapshot of the loaded images,
+ * so one costs the pages it writes and a session of a few KB. Only one VM
+ * runs at a time, so they all share a console that sends to whichever one
+ * is running. A client that does not read its output holds its VM up
+ * rather than have it pile up here.
+ */
+#define SERVE_SLICE (1 << 16)
+#define SERVE_KEYS 256 /* keys waiting for a VM, reading stops while they are all there */
+
+struct session
+{
+    int fd;
+    unsigned id;           /* in the order the connections came */
+    struct vm* vm;
+    struct kbd_fifo kbd;
+    uint16_t keys[SERVE_KEYS];
+    char* out;             /* output the socket has not taken yet */
+    size_t out_len;
+    int watched;           /* POLLER_* asked of the poller */
+    int status;            /* STOP_* once the guest is done, -1 before */
+    int broken;            /* the connection failed, throw the session away */
+    int queued;
+    struct session* next;  /* in the run queue */
+};
+
+int serve_poller;
+run_fn serve_engine;
+int serve_traps;           /* TRAPS_* */
+uint64_t serve_max_instructions;
+struct snapshot serve_base;
+struct console serve_console; /* sends to the running session */
+struct session* serve_head;/* the run queue */
+struct session* serve_tail;
+unsigned serve_sessions;
+
+void serve_queue(struct session* s)
+{
+    if (s->queued) return;
+    s->queued = 1;
+    s->next = NULL;
+    if (serve_tail) serve_tail->next = s;
+    else serve_head = s;
+    serve_tail = s;
+}
+
+/* send what the socket will take now and keep the rest for later */
+void serve_send(struct session* s, const char* text, size_t size)
+{
+    if (!s->out_len)
+    {
+        long sent = socket_write_some(s->fd, text, size);
+        if (sent == SOCKET_AGAIN) sent = 0;
+        if (sent < 0)
+        {
+            s->broken = 1;
+            return;
+        }
+        text += sent;
+        size -= (size_t)sent;
+        if (!size) return;
+    }
+    char* out = realloc(s->out, s->out_len + size);
+    if (!out)
+    {
+        s->broken = 1;
+        return;
+    }
+    memcpy(out + s->out_len, text, size);
+    s->out = out;
+    s->out_len += size;
+}
+
+/* the console's write, the running session is its user */
+void serve_write(void* user, const char* text, size_t size)
+{
+    struct session* s = user;
+    if (!s->broken) serve_send(s, text, size);
+}
+
+/* try the output that was left over again */
+void serve_drain(struct session* s)
+{
+    long sent = socket_write_some(s->fd, s->out, s->out_len);
+    if (sent == SOCKET_AGAIN) return;
+    if (sent < 0)
+    {
+        s->broken = 1;
+        return;
+    }
+    s->out_len -= (size_t)sent;
+    memmove(s->out, s->out + sent, s->out_len);
+}
+
+/* move the keys the socket has into the FIFO, end of file when the client closes */
+void serve_read(struct session* s)
+{
+    char buf[SERVE_KEYS];
+    unsigned room = SERVE_KEYS - (atomic_load(&s->kbd.head) - atomic_load(&s->kbd.tail));
+    if (!room || atomic_load(&s->kbd.closed)) return;
+    long got = socket_read_some(s->fd, buf, room);
+    if (got == SOCKET_AGAIN) return;
+    if (got <= 0)
+    {
+        /* the guest reads end of file, and may still have something to say */
+        atomic_store(&s->kbd.closed, 1);
+        if (got < 0) s->broken = 1;
+        return;
+    }
+    for (long i = 0; i < got; ++i)
+    {
+        kbd_push(&s->kbd, (uint8_t)buf[i]);
+    }
+}
+
+/* ask the poller for what `s` is waiting on */
+void serve_watch(struct session* s)
+{
+    int events = 0;
+    if (!s->broken)
+    {
+        if (s->out_len) events |= POLLER_OUT;
+        if (s->status < 0 && !kbd_full(&s->kbd) && !atomic_load(&s->kbd.closed)) events |= POLLER_IN;
+    }
+    if (events != s->watched && poller_watch(serve_poller, s->fd, s->watched, events, s))
+    {
+        s->watched = events;
+    }
+}
+
+void serve_report(struct session* s)
+{
+    fprintf(stderr, "{\"session\": %u, \"status\": \"%s\", \"instructions\": %llu, \"pc\": %u}\n",
+            s->id, s->status >= 0 ? stop_names[s->status] : "disconnected",
+            (unsigned long long)s->vm->instructions, s->vm->reg[R_PC]);
+}
+
+void serve_close(struct session* s)
+{
+    serve_report(s);
+    poller_watch(serve_poller, s->fd, s->watched, 0, s);
+    socket_close(s->fd);
+    vm_destroy(s->vm);
+    free(s->out);
+    free(s);
+}
+
+/* a session for every connection that is waiting */
+void serve_accept(int listener, int tcp)
+{
+    int fd;
+    while ((fd = socket_accept_nonblocking(listener, tcp)) >= 0)
+    {
+        struct session* s = calloc(1, sizeof(*s));
+        if (s)
+        {
+            kbd_init_empty(&s->kbd, s->keys, SERVE_KEYS);
+            s->vm = vm_create(&s->kbd, &serve_console);
+        }
+        if (!s || !s->vm || !vm_restore(s->vm, &serve_base))
+        {
+            if (s && s->vm) vm_destroy(s->vm);
+            free(s);
+            socket_close(fd);
+            continue;
+        }
+        set_traps(s->vm, serve_traps);
+        s->vm->embedder = s;
+        s->fd = fd;
+        s->id = serve_sessions++;
+        s->status = -1;
+        serve_watch(s);
+        serve_queue(s);
+    }
+}
+
+/* one slice of `s`, returns 0 once the session is over */
+int serve_turn(struct session* s)
+{
+    struct vm* vm = s->vm;
+    int again = 0;
+    if (!s->out_len && s->status < 0 && !s->broken)
+    {
+        uint64_t budget = SERVE_SLICE;
+        if (serve_max_instructions && serve_max_instructions - vm->instructions < budget)
+        {
+            budget = serve_max_instructions - vm->instructions;
+        }
+        serve_console.user = s;
+        vm->stopped = 0;
+        uint64_t executed;
+        int status = run_limited(vm, serve_engine, budget, UINT64_MAX, &executed);
+        console_flush(&serve_console);
+        if (status == STOP_BUDGET && (!serve_max_instructions || vm->instructions < serve_max_instructions))
+        {
+            again = 1;
+        }
+        else if (status != STOP_INPUT)
+        {
+            s->status = status;
+        }
+    }
+    if (s->broken || (s->status >= 0 && !s->out_len))
+    {
+        return 0;
+    }
+    if (again) serve_queue(s);
+    serve_watch(s);
+    return 1;
+}
+
+int serve_main(const char* where, const char** images, int count, struct snapshot* base, int traps,
+               uint64_t max_instructions)
+{
+    /* what every connection starts from */
+    struct vm* vm = vm_create(NULL, NULL);
+    int failed = 0;
+    int result = !vm || (base && !vm_restore(vm, base)) ? IMAGE_UNREADABLE
+                 : count ? load_images(vm, images, count, 1, &failed) : IMAGE_OK;
+    if (result != IMAGE_OK)
+    {
+        printf("failed to load image: %s %s\n", count ? images[failed] : "", image_errors[result]);
+        exit(1);
+    }
+    if (!cfg_prepare(vm) || !snapshot_create(&serve_base, vm, NULL))
+    {
+        printf("out of memory\n");
+        exit(1);
+    }
+    vm_destroy(vm);
+
+    serve_engine = engine_select(0);
+    serve_traps = traps;
+    serve_max_instructions = max_instructions;
+    serve_console.write = serve_write;
+
+    raise_file_limit();
+    int tcp;
+    int listener = socket_listen(where, SOMAXCONN, &tcp);
+    serve_poller = poller_create();
+    if (listener < 0 || serve_poller < 0 || !socket_set_nonblocking(listener)
+        || !poller_watch(serve_poller, listener, 0, POLLER_IN, NULL))
+    {
+        printf("failed to listen on: %s\n", where);
+        exit(1);
+    }
+
+    struct poller_event events[POLLER_BATCH];
+    for (;;)
+    {
+        int n = poller_wait(serve_poller, events, POLLER_BATCH, serve_head ? 0 : -1);
+        for (int i = 0; i < n; ++i)
+        {
+            struct session* s = events[i].data;
+            if (!s)
+            {
+                serve_accept(listener, tcp);
+                continue;
+            }
+            if (events[i].events & POLLER_OUT) serve_drain(s);
+            if (events[i].events & POLLER_IN) serve_read(s);
+            /* sessions only go away in their turn, later events may still name them */
+            serve_queue(s);
+        }
+
+        /* a round: everything queued now, what queues itself again runs in the next one */
+        struct session* s = serve_head;
+        serve_head = serve_tail = NULL;
+        while (s)
+        {
+            struct session* next = s->next;
+            s->queued = 0;
+            if (!serve_turn(s))
+            {
+                serve_close(s);
+            }
+            s = next;
+        }
+    }
+}
@@ -0,0 +1,202 @@
+/*
+ * Execution trace, kept by the run_trace interpreter: a ring of the last
+ * entries instructions, each its PC, the instruction word, the register in
+ * bits 11-9 after it ran and N/Z/P after it ran. Recording is a handful of
+ * stores with no branches, the result of an instruction is filled in when
+ * the next one is fetched. The ring is written out on SIGINT, abort() or
+ * when the run stops, and --trace-dump turns the file into text.
+ */
+#define TRACE_ENTRIES (1 << 16)
+#define TRACE_MAGIC "LC3T"
+
+struct trace_entry
+{
+    uint16_t pc;
+    uint16_t instr;
+    uint16_t value;  /* of the register in bits 11-9 */
+    uint16_t cond;   /* FL_* */
+};
+
+struct trace
+{
+    struct trace_entry* ring;   /* `mask + 1` entries on a cache line boundary */
+    void* block;                /* what to free */
+    uint32_t mask;
+    uint32_t pos;               /* entries ever recorded */
+    uint8_t last_r0;            /* bits 11-9 of the newest entry */
+};
+
+/* a ring of at least `entries`, rounded up to a power of two */
+struct trace* trace_create(uint32_t entries)
+{
+    uint32_t size = 1;
+    while (size < entries && size < (1u << 31)) size <<= 1;
+
+    struct trace* t = calloc(1, sizeof(*t));
+    if (!t) return NULL;
+    t->block = calloc(1, size * sizeof(struct trace_entry) + 64);
+    if (!t->block)
+    {
+        free(t);
+        return NULL;
+    }
+    t->ring = (struct trace_entry*)(((uintptr_t)t->block + 63) & ~(uintptr_t)63);
+    t->mask = size - 1;
+    return t;
+}
+
+/* record the instruction `d` at `pc`, and the result of the one before */
+static inline void trace_step(struct vm* vm, uint16_t pc, struct decoded* d)
+{
+    struct trace* t = vm->trace;
+    struct trace_entry* prev = &t->ring[(t->pos - 1) & t->mask];
+    prev->value = vm->reg[t->last_r0];
+    prev->cond = cond_flags(vm);
+
+    struct trace_entry* e = &t->ring[t->pos++ & t->mask];
+    e->pc = pc;
+    e->instr = vm->memory[pc];
+    t->last_r0 = d->r0;
+}
+
+/* oldest entry first, after filling in the result of the newest; safe in a signal handler */
+int trace_write(struct vm* vm, const char* path)
+{
+    struct trace* t = vm->trace;
+    if (t->pos)
+    {
+        struct trace_entry* last = &t->ring[(t->pos - 1) & t->mask];
+        last->value = vm->reg[t->last_r0];
+        last->cond = cond_flags(vm);
+    }
+
+    int out = file_create(path);
+    if (out < 0) return 0;
+
+    uint32_t count = t->pos > t->mask ? t->mask + 1 : t->pos;
+    uint32_t first = t->pos - count;
+    char head[8];
+    memcpy(head, TRACE_MAGIC, 4);
+    memcpy(head + 4, &count, sizeof(count));
+    int ok = file_write(out, head, sizeof(head));
+    for (uint32_t i = 0; i < count && ok; )
+    {
+        /* the ring in at most two pieces */
+        uint32_t at = (first + i) & t->mask;
+        uint32_t n = count - i < t->mask + 1 - at ? count - i : t->mask + 1 - at;
+        ok = file_write(out, &t->ring[at], n * sizeof(struct trace_entry));
+        i += n;
+    }
+    return file_close(out) && ok;
+}
+
+/* `instr` at `pc` as assembly */
+void disassemble(char* buf, size_t size, uint16_t pc, uint16_t instr)
+{
+    const char** names = op_names;
+    unsigned op = instr >> 12;
+    unsigned r0 = (instr >> 9) & R_BITMASK;
+    unsigned r1 = (instr >> 6) & R_BITMASK;
+    uint16_t pc9 = pc + 1 + sign_extend(instr & 0x1FF, 9);
+
+    switch (op)
+    {
+        case OP_ADD:
+        case OP_AND:
+            if (instr & 0x20)
+                snprintf(buf, size, "%s R%u, R%u, #%d", names[op], r0, r1, (int16_t)sign_extend(instr & 0x1F, 5));
+            else
+                snprintf(buf, size, "%s R%u, R%u, R%u", names[op], r0, r1, instr & R_BITMASK);
+            break;
+        case OP_BR:
+            snprintf(buf, size, "BR%s%s%s x%04X", r0 & 4 ? "n" : "", r0 & 2 ? "z" : "", r0 & 1 ? "p" : "", pc9);
+            break;
+        case OP_LD:
+        case OP_LDI:
+        case OP_LEA:
+        case OP_ST:
+        case OP_STI:
+            snprintf(buf, size, "%s R%u, x%04X", names[op], r0, pc9);
+            break;
+        case OP_LDR:
+        case OP_STR:
+            snprintf(buf, size, "%s R%u, R%u, #%d", names[op], r0, r1, (int16_t)sign_extend(instr & 0x3F, 6));
+            break;
+        case OP_JSR:
+            if (instr & 0x800)
+                snprintf(buf, size, "JSR x%04X", (uint16_t)(pc + 1 + sign_extend(instr & 0x7FF, 11)));
+            else
+                snprintf(buf, size, "JSRR R%u", r1);
+            break;
+        case OP_JMP:
+            if (r1 == R_R7)
+                snprintf(buf, size, "RET");
+            else
+                snprintf(buf, size, "JMP R%u", r1);
+            break;
+        case OP_NOT:
+            snprintf(buf, size, "NOT R%u, R%u", r0, r1);
+            break;
+        case OP_TRAP:
+            snprintf(buf, size, "TRAP x%02X", instr & 0xFF);
+            break;
+        default:
+            snprintf(buf, size, "%s", names[op]);
+            break;
+    }
+}
+
+/* print a trace file as text on stdout */
+int trace_dump(const char* path)
+{
+    size_t size;
+    const uint8_t* data = map_file(path, &size);
+    if (!data) return IMAGE_UNREADABLE;
+
+    uint32_t count = 0;
+    if (size >= 8)
+    {
+        memcpy(&count, data + 4, 4);
+    }
+    if (size < 8 || memcmp(data, TRACE_MAGIC, 4) != 0 || (size - 8) / sizeof(struct trace_entry) < count)
+    {
+        unmap_file(data, size);
+        return IMAGE_TRUNCATED;
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        struct trace_entry e;
+        char text[32];
+        memcpy(&e, data + 8 + i * sizeof(e), sizeof(e));
+        disassemble(text, sizeof(text), e.pc, e.instr);
+        printf("x%04X  %04X  %-20s R%u=x%04X %c%c%c\n", e.pc, e.instr, text, (e.instr >> 9) & R_BITMASK, e.value,
+               e.cond & FL_NEG ? 'n' : '-', e.cond & FL_ZRO ? 'z' : '-', e.cond & FL_POS ? 'p' : '-');
+    }
+    unmap_file(data, size);
+    return IMAGE_OK;
+}
+
+struct vm* trace_vm;
+const char* trace_path;
+
+void trace_save()
+{
+    if (!trace_write(trace_vm, trace_path))
+    {
+        fprintf(stderr, "failed to write trace: %s\n", trace_path);
+    }
+}
+
+/* the guest ran an illegal instruction, keep what led up to it; stdio may be halfway through a call */
+void trace_abort(int sig)
+{
+    static const char failed[] = "failed to write trace\n";
+    if (!trace_write(trace_vm, trace_path))
+    {
+        file_write(2, failed, sizeof(failed) - 1);
+    }
+    restore_input_buffering();
+    signal(SIGABRT, SIG_DFL);
+    abort();
+}
@@ -0,0 +1,157 @@
+/*
+ * TRAP routines. Every VM has a table of 256 handlers, one per vector, each
+ * either native C below or trap_guest(), which runs the routine the guest
+ * put at memory[vector] the way the hardware would. set_traps() fills the
+ * table for a --traps mode once the images are loaded:
+ *
+ *   native  the standard vectors x20-x25 in C, the others in the guest
+ *   guest   everything in the guest, for images that bring their own OS
+ *   auto    like native if no trap table is loaded or if it is the
+ *           standard LC-3 OS's, otherwise the guest's own routines win
+ */
+enum
+{
+    TRAPS_NATIVE,
+    TRAPS_GUEST,
+    TRAPS_AUTO
+};
+
+const char* trap_modes[] = { "native", "guest", "auto" };
+
+/* what the hardware does: R7 = PC, PC = memory[vector] */
+void trap_guest(struct vm* vm, uint16_t vector)
+{
+    uint16_t routine = vm->memory[vector];
+    /* nothing loaded there, so nothing to run, as before the table existed */
+    if (routine)
+    {
+        vm->reg[R_PC] = routine;
+    }
+}
+
+void trap_getc(struct vm* vm, uint16_t vector)
+{
+    if (script_wait(vm)) return;
+    console_flush_for_input(vm->console);
+    if (kbd_empty(vm->kbd)) display_idle(vm);
+    vm->reg[R_R0] = kbd_getc(vm->kbd);
+    update_flags(vm, R_R0);
+}
+
+void trap_out(struct vm* vm, uint16_t vector)
+{
+    console_putc(vm->console, (char)vm->reg[R_R0]);
+}
+
+/*
+ * The string routines convert a chunk at a time and hand it to the console
+ * in one write. They stop at the device page, which holds no strings, so a
+ * missing terminator cannot run them off the end of memory.
+ */
+#define TRAP_CHUNK 256
+
+void trap_puts(struct vm* vm, uint16_t vector)
+{
+    char text[TRAP_CHUNK];
+    uint32_t a = vm->reg[R_R0];
+    size_t n;
+    do
+    {
+        n = 0;
+        while (n < TRAP_CHUNK && a < MR_IO && vm->memory[a])
+        {
+            text[n++] = (char)vm->memory[a++];
+        }
+        console_write(vm->console, text, n);
+    } while (n == TRAP_CHUNK);
+}
+
+void trap_in(struct vm* vm, uint16_t vector)
+{
+    if (script_wait(vm)) return;
+    struct console* con = vm->console;
+    const char prompt[] = "Enter a character: ";
+    console_write(con, prompt, sizeof(prompt) - 1);
+
+    console_flush_for_input(con);
+    if (kbd_empty(vm->kbd)) display_idle(vm);
+    char c = kbd_getc(vm->kbd);
+    console_putc(con, c);
+    console_flush_for_input(con);
+    vm->reg[R_R0] = (uint16_t)c;
+
+    update_flags(vm, R_R0);
+}
+
+/* two characters a word, low byte first, a zero high byte is left out */
+void trap_putsp(struct vm* vm, uint16_t vector)
+{
+    char text[TRAP_CHUNK];
+    uint32_t a = vm->reg[R_R0];
+    size_t n;
+    do
+    {
+        n = 0;
+        while (n < TRAP_CHUNK - 1 && a < MR_IO && vm->memory[a])
+        {
+            uint16_t w = vm->memory[a++];
+            text[n++] = (char)(w & 0xFF);
+            if (w >> 8) text[n++] = (char)(w >> 8);
+        }
+        console_write(vm->console, text, n);
+    } while (n >= TRAP_CHUNK - 1);
+}
+
+void trap_halt(struct vm* vm, uint16_t vector)
+{
+    console_write(vm->console, "HALT\n", 5);
+    console_flush(vm->console);
+    vm->running = 0;
+    vm->yield = 1;
+}
+
+trap_fn native_traps[] = { trap_getc, trap_out, trap_puts, trap_in, trap_putsp, trap_halt };
+
+/*
+ * The standard LC-3 OS fills the whole table: a routine of its own in
+ * system space for each standard vector and one shared bad-trap routine for
+ * all the others. Any other table is the guest's own.
+ */
+int standard_os_loaded(struct vm* vm)
+{
+    const uint16_t* table = vm->memory;
+    uint16_t bad = table[0];
+    if (!bad) return 0;
+    for (int v = 0; v < 256; ++v)
+    {
+        if (v >= TRAP_GETC && v <= TRAP_HALT)
+        {
+            if (table[v] == bad || table[v] < 0x0200 || table[v] >= PC_START) return 0;
+        }
+        else if (table[v] != bad)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void set_traps(struct vm* vm, int mode)
+{
+    int native = mode == TRAPS_NATIVE || (mode == TRAPS_AUTO && standard_os_loaded(vm));
+    for (int v = 0; v < 256; ++v)
+    {
+        vm->traps[v] = trap_guest;
+        if (v >= TRAP_GETC && v <= TRAP_HALT
+            && (native || (mode == TRAPS_AUTO && !vm->memory[v])))
+        {
+            vm->traps[v] = native_traps[v - TRAP_GETC];
+        }
+    }
+}
+
+void trap(struct vm* vm, uint16_t vector)
+{
+    vm->reg[R_R7] = vm->reg[R_PC];
+    vm->traps[vector](vm, vector);
+}
@@ -1,51 +1,716 @@
+#include <stdatomic.h>
+
+/*
+ * Keystrokes for a VM come from one of these FIFOs, so polling the keyboard
+ * is a memory check instead of a system call. For stdin a background thread
+ * is the only writer of head and the interpreter the only writer of tail.
+ * Input read from a file up front is a FIFO that is already full and closed.
+ */
+#define KBD_FIFO_SIZE 1024
+
+struct kbd_fifo
+{
+    uint16_t* data;
+    unsigned size;
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_int closed; /* the input reached end of file */
+};
+
+uint16_t stdin_keys[KBD_FIFO_SIZE];
+struct kbd_fifo stdin_kbd = { stdin_keys, KBD_FIFO_SIZE };
+
+/* a closed FIFO holding `count` keys that stay owned by the caller */
+void kbd_init_keys(struct kbd_fifo* kbd, uint16_t* keys, unsigned count)
+{
+    kbd->data = keys;
+    kbd->size = count;
+    atomic_init(&kbd->head, count);
+    atomic_init(&kbd->tail, 0);
+    atomic_init(&kbd->closed, 1);
+}
+
+/* an open, empty FIFO with room for `size` keys, also owned by the caller */
+void kbd_init_empty(struct kbd_fifo* kbd, uint16_t* keys, unsigned size)
+{
+    kbd->data = keys;
+    kbd->size = size;
+    atomic_init(&kbd->head, 0);
+    atomic_init(&kbd->tail, 0);
+    atomic_init(&kbd->closed, 0);
+}
+
+int kbd_full(struct kbd_fifo* kbd)
+{
+    return atomic_load(&kbd->head) - atomic_load(&kbd->tail) == kbd->size;
+}
+
+void kbd_push(struct kbd_fifo* kbd, uint16_t c)
+{
+    unsigned head = atomic_load_explicit(&kbd->head, memory_order_relaxed);
+    kbd->data[head % kbd->size] = c;
+    atomic_store_explicit(&kbd->head, head + 1, memory_order_release);
+}
+
+/* take the next key if there is one, at end of file that is always EOF */
+int kbd_pop(struct kbd_fifo* kbd, uint16_t* c)
+{
+    unsigned tail = atomic_load_explicit(&kbd->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&kbd->head, memory_order_acquire))
+    {
+        if (!atomic_load(&kbd->closed)) return 0;
+        *c = (uint16_t) EOF;
+        return 1;
+    }
+    *c = kbd->data[tail % kbd->size];
+    atomic_store_explicit(&kbd->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+int kbd_empty(struct kbd_fifo* kbd)
+{
+    return atomic_load(&kbd->tail) == atomic_load(&kbd->head) && !atomic_load(&kbd->closed);
+}
+
+/* copy up to `max` of the keys waiting in `kbd` without taking them */
+unsigned kbd_peek(struct kbd_fifo* kbd, uint16_t* keys, unsigned max)
+{
+    unsigned tail = atomic_load(&kbd->tail);
+    unsigned head = atomic_load_explicit(&kbd->head, memory_order_acquire);
+    unsigned n = 0;
+    for (; tail != head && n < max; ++tail)
+    {
+        keys[n++] = kbd->data[tail % kbd->size];
+    }
+    return n;
+}
+
+/* the value of the hex digit `c`, -1 if it is not one */
+int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Guest output is collected here and written out with one call when a line
+ * ends, the buffer fills, the guest is about to wait for input or halts. In
+ * fully buffered mode only a full buffer or halting flushes it.
+ */
+#define CONSOLE_BUF_SIZE (64 * 1024)
+
+struct console
+{
+    char buf[CONSOLE_BUF_SIZE];
+    size_t len;
+    FILE* out;
+    int fully_buffered;
+    void (*write)(void* user, const char* text, size_t size); /* instead of `out` if set */
+    void* user;
+};
+
+struct console stdout_console;
+
+void console_flush(struct console* con)
+{
+    if (con->len)
+    {
+        /* a console without a file just drops the output */
+        if (con->write)
+        {
+            con->write(con->user, con->buf, con->len);
+        }
+        else if (con->out)
+        {
+            fwrite(con->buf, 1, con->len, con->out);
+            fflush(con->out);
+        }
+        con->len = 0;
+    }
+}
+
+void console_putc(struct console* con, char c)
+{
+    con->buf[con->len++] = c;
+    if (con->len == CONSOLE_BUF_SIZE || (c == '\n' && !con->fully_buffered))
+    {
+        console_flush(con);
+    }
+}
+
+/* the same as console_putc() for each of `s`, with one copy per buffer's worth */
+void console_write(struct console* con, const char* s, size_t n)
+{
+    while (n)
+    {
+        size_t room = CONSOLE_BUF_SIZE - con->len;
+        size_t k = n < room ? n : room;
+        memcpy(con->buf + con->len, s, k);
+        con->len += k;
+        if (con->len == CONSOLE_BUF_SIZE || (!con->fully_buffered && memchr(s, '\n', k)))
+        {
+            console_flush(con);
+        }
+        s += k;
+        n -= k;
+    }
+}
+
+/* the guest is about to wait for input, so it should see its prompt */
+void console_flush_for_input(struct console* con)
+{
+    if (!con->fully_buffered)
+    {
+        console_flush(con);
+    }
+}
+
+/*
+ * What --serve needs of the platform: sockets that never block and a
+ * poller telling which of them are ready. Reads and writes on them return
+ * SOCKET_AGAIN where a blocking socket would have waited.
+ */
+#define SOCKET_AGAIN (-2)
+#define POLLER_BATCH 256 /* events one poller_wait() returns at most */
+
+enum { POLLER_IN = 1 << 0, POLLER_OUT = 1 << 1 };
+
+struct poller_event
+{
+    void* data;
+    int events;    /* POLLER_*, both for errors so the next read or write sees them */
+};
+
 #ifdef linux
 
 #include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/termios.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <linux/perf_event.h>
 
 struct termios original_tio;
+int tio_changed;
 
 void disable_input_buffering()
 {
-    tcgetattr(STDIN_FILENO, &original_tio);
+    /* leave stdin alone when it is not a terminal */
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &original_tio) != 0)
+    {
+        return;
+    }
     struct termios new_tio = original_tio;
     new_tio.c_lflag &= ~ICANON & ~ECHO;
     tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+    tio_changed = 1;
 }
 
 void restore_input_buffering()
 {
-    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    if (tio_changed)
+    {
+        tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    }
+}
+
+/* make `path` the program's stdin */
+int input_from_file(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    dup2(fd, STDIN_FILENO);
+    close(fd);
+    return 1;
+}
+
+pthread_mutex_t input_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t input_cond = PTHREAD_COND_INITIALIZER;
+
+void input_signal()
+{
+    pthread_mutex_lock(&input_lock);
+    pthread_cond_broadcast(&input_cond);
+    pthread_mutex_unlock(&input_lock);
+}
+
+/* sleep until a key arrives in `kbd` or `ms` pass, forever if `ms` is negative */
+void input_wait(struct kbd_fifo* kbd, int ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&input_lock);
+    while (kbd_empty(kbd))
+    {
+        if (ms < 0)
+        {
+            pthread_cond_wait(&input_cond, &input_lock);
+        }
+        else if (pthread_cond_timedwait(&input_cond, &input_lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&input_lock);
+}
+
+void* input_thread(void* arg)
+{
+    unsigned char buf[256];
+    for (;;)
+    {
+        ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        for (ssize_t i = 0; i < n; ++i)
+        {
+            while (kbd_full(&stdin_kbd))
+            {
+                usleep(1000);
+            }
+            kbd_push(&stdin_kbd, buf[i]);
+        }
+        input_signal();
+    }
+    atomic_store(&stdin_kbd.closed, 1);
+    input_signal();
+    return NULL;
+}
+
+void input_start()
+{
+    pthread_t thread;
+    pthread_create(&thread, NULL, input_thread, NULL);
+    pthread_detach(thread);
+}
+
+struct watchdog
+{
+    uint64_t ns;
+    void (*fire)(void);
+};
+
+void* watchdog_thread(void* arg)
+{
+    struct watchdog* w = arg;
+    struct timespec ts = { (time_t)(w->ns / 1000000000), (long)(w->ns % 1000000000) };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+    w->fire();
+    return NULL;
+}
+
+/* call `fire` on another thread after `ns`, even if the main thread is blocked */
+void watchdog_start(uint64_t ns, void (*fire)(void))
+{
+    static struct watchdog w;
+    w.ns = ns;
+    w.fire = fire;
+    pthread_t thread;
+    pthread_create(&thread, NULL, watchdog_thread, &w);
+    pthread_detach(thread);
+}
+
+struct thread
+{
+    pthread_t handle;
+    void (*fn)(void* arg);
+    void* arg;
+};
+
+void* thread_main(void* arg)
+{
+    struct thread* t = arg;
+    t->fn(t->arg);
+    return NULL;
+}
+
+int thread_start(struct thread* t, void (*fn)(void* arg), void* arg)
+{
+    t->fn = fn;
+    t->arg = arg;
+    return pthread_create(&t->handle, NULL, thread_main, t) == 0;
+}
+
+void thread_join(struct thread* t)
+{
+    pthread_join(t->handle, NULL);
+}
+
+int cpu_count()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+}
+
+/* a private copy-on-write view of the first `size` bytes of `file` */
+void* map_copy(FILE* file, size_t size)
+{
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file), 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+void unmap_copy(void* p, size_t size)
+{
+    munmap(p, size);
+}
+
+/*
+ * Writing files without stdio, for what has to be safe in a signal
+ * handler: a descriptor for `path`, emptied, or -1
+ */
+int file_create(const char* path)
+{
+    int fd;
+    while ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0 && errno == EINTR);
+    return fd;
+}
+
+/* all `n` bytes, returns 0 on errors */
+int file_write(int fd, const void* buf, size_t n)
+{
+    const char* p = buf;
+    while (n)
+    {
+        ssize_t written = write(fd, p, n);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return 0;
+        p += written;
+        n -= (size_t) written;
+    }
+    return 1;
+}
+
+int file_close(int fd)
+{
+    return close(fd) == 0;
+}
+
+/* map all of `path` read-only, NULL if it cannot be opened */
+const uint8_t* map_file(const char* path, size_t* size)
+{
+    static const uint8_t empty[1];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    *size = (size_t) st.st_size;
+    void* p = *size ? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : (void*) empty;
+    close(fd);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+void unmap_file(const uint8_t* p, size_t size)
+{
+    if (size)
+    {
+        munmap((void*) p, size);
+    }
+}
+
+/* a counter of this thread's branch misses, -1 where perf events are not allowed */
+int branch_counter_open()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void branch_counter_start(int fd)
+{
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+/* misses since branch_counter_start(), -1 without a counter */
+int64_t branch_counter_read(int fd)
+{
+    int64_t count;
+    if (fd < 0)
+    {
+        return -1;
+    }
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    return read(fd, &count, sizeof(count)) == sizeof(count) ? count : -1;
+}
+
+void branch_counter_close(int fd)
+{
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+/*
+ * listen on `where`, a TCP port on localhost when it is all digits and a
+ * Unix socket path otherwise; -1 if that fails, `tcp` says which it was
+ */
+int socket_listen(const char* where, int backlog, int* tcp)
+{
+    const char* p = where;
+    long port = 0;
+    while (*p >= '0' && *p <= '9' && port <= 0xFFFF) port = port * 10 + (*p++ - '0');
+    *tcp = p != where && *p == '\0';
+
+    int listener;
+    if (*tcp)
+    {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t) port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int on = 1;
+        listener = port <= 0xFFFF ? socket(AF_INET, SOCK_STREAM, 0) : -1;
+        if (listener >= 0 && (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0
+                              || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0))
+        {
+            close(listener);
+            listener = -1;
+        }
+    }
+    else
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(where) >= sizeof(addr.sun_path)) return -1;
+        strcpy(addr.sun_path, where);
+        unlink(where);
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener >= 0 && bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+        {
+            close(listener);
+            listener = -1;
+        }
+    }
+    if (listener < 0 || listen(listener, backlog) != 0)
+    {
+        if (listener >= 0) close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+/* wait for one connection on `where`, see socket_listen(); -1 if that fails */
+int socket_accept_one(const char* where)
+{
+    int tcp;
+    int listener = socket_listen(where, 1, &tcp);
+    if (listener < 0)
+    {
+        return -1;
+    }
+
+    int fd;
+    while ((fd = accept(listener, NULL, NULL)) < 0 && errno == EINTR);
+    close(listener);
+    if (fd >= 0 && tcp)
+    {
+        /* packets are small and every one waits for an answer */
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    return fd;
+}
+
+int socket_set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
 }
 
-uint16_t check_key()
+/* the next connection on `listener` as a socket that does not block, -1 if none is waiting */
+int socket_accept_nonblocking(int listener, int tcp)
 {
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
+    int fd;
+    while ((fd = accept(listener, NULL, NULL)) < 0 && errno == EINTR);
+    if (fd >= 0 && !socket_set_nonblocking(fd))
+    {
+        close(fd);
+        return -1;
+    }
+    if (fd >= 0 && tcp)
+    {
+        /* a terminal session, every key and line should go out as it comes */
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    return fd;
+}
 
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    return select(1, &readfds, NULL, NULL, &timeout) != 0;
+/* bytes read, 0 once the other end has closed, SOCKET_AGAIN or -1 on errors */
+long socket_read_some(int fd, void* buf, size_t n)
+{
+    ssize_t got;
+    while ((got = recv(fd, buf, n, 0)) < 0 && errno == EINTR);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return SOCKET_AGAIN;
+    return (long) got;
+}
+
+/* bytes written, which may be fewer than `n`, SOCKET_AGAIN or -1 on errors */
+long socket_write_some(int fd, const void* buf, size_t n)
+{
+    ssize_t sent;
+    while ((sent = send(fd, buf, n, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return SOCKET_AGAIN;
+    return (long) sent;
+}
+
+/* epoll on Linux */
+int poller_create()
+{
+    return epoll_create1(EPOLL_CLOEXEC);
+}
+
+/* watch `fd` for `events` instead of `before` (both POLLER_*, 0 for not watched) */
+int poller_watch(int poller, int fd, int before, int events, void* data)
+{
+    if (!before && !events) return 1;
+    struct epoll_event e;
+    e.events = (events & POLLER_IN ? EPOLLIN : 0) | (events & POLLER_OUT ? EPOLLOUT : 0);
+    e.data.ptr = data;
+    int op = !before ? EPOLL_CTL_ADD : !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    return epoll_ctl(poller, op, fd, &e) == 0;
+}
+
+/* up to `max` (at most POLLER_BATCH) ready sockets, waiting `ms` for one, -1 for ever */
+int poller_wait(int poller, struct poller_event* out, int max, int ms)
+{
+    struct epoll_event e[POLLER_BATCH];
+    int n;
+    while ((n = epoll_wait(poller, e, max < POLLER_BATCH ? max : POLLER_BATCH, ms)) < 0 && errno == EINTR);
+    for (int i = 0; i < n; ++i)
+    {
+        out[i].data = e[i].data.ptr;
+        out[i].events = (e[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) ? POLLER_IN : 0)
+                        | (e[i].events & (EPOLLOUT | EPOLLERR) ? POLLER_OUT : 0);
+    }
+    return n;
+}
+
+void poller_close(int poller)
+{
+    close(poller);
+}
+
+/* let the process have as many sockets open as it is allowed */
+void raise_file_limit()
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/* bytes read into `buf`, 0 once the other end has closed, -1 on errors */
+long socket_read(int fd, void* buf, size_t n)
+{
+    ssize_t got;
+    while ((got = recv(fd, buf, n, 0)) < 0 && errno == EINTR);
+    return (long) got;
+}
+
+int socket_write(int fd, const void* buf, size_t n)
+{
+    const char* p = buf;
+    while (n)
+    {
+        ssize_t sent = send(fd, p, n, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return 0;
+        p += sent;
+        n -= (size_t) sent;
+    }
+    return 1;
+}
+
+/* something can be read without blocking */
+int socket_ready(int fd)
+{
+    struct pollfd p = { fd, POLLIN, 0 };
+    return poll(&p, 1, 0) > 0;
+}
+
+void socket_close(int fd)
+{
+    close(fd);
+}
+
+uint64_t clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 #elif defined _WIN32
 
 #include <Windows.h>
 #include <conio.h>  // _kbhit
+#include <io.h>     // _get_osfhandle, _open
+#include <fcntl.h>
+#include <sys/stat.h>
 HANDLE hStdin = INVALID_HANDLE_VALUE;
 DWORD fdwMode, fdwOldMode;
 
+int console_mode_changed;
+
 void disable_input_buffering()
 {
     hStdin = GetStdHandle(STD_INPUT_HANDLE);
-    GetConsoleMode(hStdin, &fdwOldMode); /* save old mode */
+    if (!GetConsoleMode(hStdin, &fdwOldMode)) /* save old mode */
+    {
+        return; /* not a console */
+    }
+    console_mode_changed = 1;
     fdwMode = fdwOldMode
             ^ ENABLE_ECHO_INPUT  /* no input echo */
             ^ ENABLE_LINE_INPUT; /* return when one or
@@ -56,20 +721,304 @@ void disable_input_buffering()
 
 void restore_input_buffering()
 {
-    SetConsoleMode(hStdin, fdwOldMode);
+    if (console_mode_changed)
+    {
+        SetConsoleMode(hStdin, fdwOldMode);
+    }
+}
+
+/* make `path` the program's stdin */
+int input_from_file(const char* path)
+{
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return 0;
+    }
+    SetStdHandle(STD_INPUT_HANDLE, file);
+    return 1;
 }
 
-__UINT16_TYPE__ check_key()
+CRITICAL_SECTION input_lock;
+CONDITION_VARIABLE input_cond;
+
+void input_signal()
 {
-    return WaitForSingleObject(hStdin, 1000) == WAIT_OBJECT_0 && _kbhit();
+    EnterCriticalSection(&input_lock);
+    WakeAllConditionVariable(&input_cond);
+    LeaveCriticalSection(&input_lock);
+}
+
+/* sleep until a key arrives in `kbd` or `ms` pass, forever if `ms` is negative */
+void input_wait(struct kbd_fifo* kbd, int ms)
+{
+    EnterCriticalSection(&input_lock);
+    while (kbd_empty(kbd))
+    {
+        if (!SleepConditionVariableCS(&input_cond, &input_lock, ms < 0 ? INFINITE : (DWORD) ms) && ms >= 0)
+        {
+            break;
+        }
+    }
+    LeaveCriticalSection(&input_lock);
+}
+
+DWORD WINAPI input_thread(LPVOID arg)
+{
+    HANDLE in = GetStdHandle(STD_INPUT_HANDLE);
+    unsigned char buf[256];
+    DWORD n;
+    while (ReadFile(in, buf, sizeof(buf), &n, NULL) && n > 0)
+    {
+        for (DWORD i = 0; i < n; ++i)
+        {
+            while (kbd_full(&stdin_kbd))
+            {
+                Sleep(1);
+            }
+            kbd_push(&stdin_kbd, buf[i]);
+        }
+        input_signal();
+    }
+    atomic_store(&stdin_kbd.closed, 1);
+    input_signal();
+    return 0;
+}
+
+struct watchdog
+{
+    uint64_t ns;
+    void (*fire)(void);
+};
+
+DWORD WINAPI watchdog_thread(LPVOID arg)
+{
+    struct watchdog* w = arg;
+    Sleep((DWORD)(w->ns / 1000000));
+    w->fire();
+    return 0;
+}
+
+/* call `fire` on another thread after `ns`, even if the main thread is blocked */
+void watchdog_start(uint64_t ns, void (*fire)(void))
+{
+    static struct watchdog w;
+    w.ns = ns;
+    w.fire = fire;
+    CloseHandle(CreateThread(NULL, 0, watchdog_thread, &w, 0, NULL));
+}
+
+void input_start()
+{
+    InitializeCriticalSection(&input_lock);
+    InitializeConditionVariable(&input_cond);
+    CloseHandle(CreateThread(NULL, 0, input_thread, NULL, 0, NULL));
+}
+
+struct thread
+{
+    HANDLE handle;
+    void (*fn)(void* arg);
+    void* arg;
+};
+
+DWORD WINAPI thread_main(LPVOID arg)
+{
+    struct thread* t = arg;
+    t->fn(t->arg);
+    return 0;
+}
+
+int thread_start(struct thread* t, void (*fn)(void* arg), void* arg)
+{
+    t->fn = fn;
+    t->arg = arg;
+    t->handle = CreateThread(NULL, 0, thread_main, t, 0, NULL);
+    return t->handle != NULL;
+}
+
+void thread_join(struct thread* t)
+{
+    WaitForSingleObject(t->handle, INFINITE);
+    CloseHandle(t->handle);
+}
+
+int cpu_count()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int) info.dwNumberOfProcessors : 1;
+}
+
+/* a private copy-on-write view of the first `size` bytes of `file` */
+void* map_copy(FILE* file, size_t size)
+{
+    HANDLE map = CreateFileMappingA((HANDLE)_get_osfhandle(_fileno(file)), NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if (!map)
+    {
+        return NULL;
+    }
+    void* p = MapViewOfFile(map, FILE_MAP_COPY, 0, 0, size);
+    CloseHandle(map);
+    return p;
+}
+
+void unmap_copy(void* p, size_t size)
+{
+    UnmapViewOfFile(p);
+}
+
+int file_create(const char* path)
+{
+    return _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+}
+
+int file_write(int fd, const void* buf, size_t n)
+{
+    const char* p = buf;
+    while (n)
+    {
+        unsigned chunk = n > 0x40000000 ? 0x40000000 : (unsigned) n;
+        int written = _write(fd, p, chunk);
+        if (written <= 0) return 0;
+        p += written;
+        n -= (size_t) written;
+    }
+    return 1;
+}
+
+int file_close(int fd)
+{
+    return _close(fd) == 0;
+}
+
+/* map all of `path` read-only, NULL if it cannot be opened */
+const uint8_t* map_file(const char* path, size_t* size)
+{
+    static const uint8_t empty[1];
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return NULL;
+    }
+    LARGE_INTEGER length;
+    if (!GetFileSizeEx(file, &length))
+    {
+        CloseHandle(file);
+        return NULL;
+    }
+    *size = (size_t) length.QuadPart;
+    if (*size == 0)
+    {
+        CloseHandle(file);
+        return empty;
+    }
+    HANDLE map = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!map)
+    {
+        return NULL;
+    }
+    const uint8_t* p = MapViewOfFile(map, FILE_MAP_READ, 0, 0, *size);
+    CloseHandle(map);
+    return p;
+}
+
+void unmap_file(const uint8_t* p, size_t size)
+{
+    if (size)
+    {
+        UnmapViewOfFile(p);
+    }
+}
+
+/* no branch miss counters on Windows */
+int branch_counter_open() { return -1; }
+void branch_counter_start(int fd) {}
+int64_t branch_counter_read(int fd) { return -1; }
+void branch_counter_close(int fd) {}
+
+/* no debugger connections on Windows */
+int socket_accept_one(const char* where) { return -1; }
+long socket_read(int fd, void* buf, size_t n) { return -1; }
+int socket_write(int fd, const void* buf, size_t n) { return 0; }
+int socket_ready(int fd) { return 0; }
+void socket_close(int fd) {}
+
+/* and no --serve */
+int socket_listen(const char* where, int backlog, int* tcp) { return -1; }
+int socket_accept_nonblocking(int listener, int tcp) { return -1; }
+int socket_set_nonblocking(int fd) { return 0; }
+long socket_read_some(int fd, void* buf, size_t n) { return -1; }
+long socket_write_some(int fd, const void* buf, size_t n) { return -1; }
+int poller_create() { return -1; }
+int poller_watch(int poller, int fd, int before, int events, void* data) { return 0; }
+int poller_wait(int poller, struct poller_event* out, int max, int ms) { return -1; }
+void poller_close(int poller) {}
+void raise_file_limit() {}
+
+uint64_t clock_ns()
+{
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000
+        + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
 }
 
 #endif
 
 
-void handle_interrupt(int signal)
+/*
+ * called on SIGINT before the program exits, to save what it can; it uses
+ * stdio, which the signal may have interrupted, so the handler only sets
+ * interrupt_pending and the run calls interrupt_exit() between slices
+ */
+void (*interrupt_hook)(void);
+volatile sig_atomic_t interrupt_pending;
+
+#define INTERRUPT_CHECK_MS 50 /* how long a wait for a key goes without looking at interrupt_pending */
+
+void interrupt_exit()
 {
+    console_flush(&stdout_console);
+    if (interrupt_hook)
+    {
+        interrupt_hook();
+    }
     restore_input_buffering();
     printf("\n");
     exit(-2);
 }
+
+void handle_interrupt(int signal)
+{
+    if (!interrupt_hook)
+    {
+        interrupt_exit();
+    }
+    if (interrupt_pending)
+    {
+        /* a second ^C does not wait for the first */
+        restore_input_buffering();
+        _Exit(-2);
+    }
+    interrupt_pending = 1;
+}
+
+/* block until the next key */
+uint16_t kbd_getc(struct kbd_fifo* kbd)
+{
+    uint16_t c;
+    while (!kbd_pop(kbd, &c))
+    {
+        if (interrupt_pending)
+        {
+            interrupt_exit();
+        }
+        input_wait(kbd, interrupt_hook ? INTERRUPT_CHECK_MS : -1);
+    }
+    return c;
+}